@@ -0,0 +1,202 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "access_log.h"
+#include "timestamp.h"
+
+#define CACHE_LINE_SIZE 64
+// longest line: a record with all its strings full
+#define ACCESS_LOG_LINE_MAX (INET6_ADDRSTRLEN + ACCESS_LOG_PATH_MAX + ACCESS_LOG_VERSION_MAX + 128)
+
+// Single producer, the thread owning it, single consumer, the logger.
+struct access_log_ring {
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // next record to fill
+  atomic_size_t dropped;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // next record to write out
+  struct access_log_record records[ACCESS_LOG_RING_SIZE];
+};
+
+static struct access_log_ring* rings[ACCESS_LOG_MAX_THREADS];
+static atomic_int nb_rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct access_log_ring* own_ring;
+
+static int log_fd = -1;
+static enum access_log_policy log_policy;
+static pthread_t logger;
+static atomic_bool running;
+static atomic_bool stopping;
+static atomic_bool sleeping;
+static _Atomic uint32_t wakeup;
+
+static void access_log_wake(void) {
+  if (atomic_load(&sleeping)) {
+    atomic_fetch_add(&wakeup, 1);
+    syscall(SYS_futex, (uint32_t*) &wakeup, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+static struct access_log_ring* access_log_register(void) {
+  struct access_log_ring* ring = NULL;
+  pthread_mutex_lock(&rings_lock);
+  int n = atomic_load_explicit(&nb_rings, memory_order_relaxed);
+  if (n < ACCESS_LOG_MAX_THREADS && posix_memalign((void**) &ring, CACHE_LINE_SIZE, sizeof(*ring)) == 0) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->tail, 0);
+    rings[n] = ring;
+    atomic_store_explicit(&nb_rings, n + 1, memory_order_release);
+  }
+  pthread_mutex_unlock(&rings_lock);
+  return ring;
+}
+
+struct access_log_record* access_log_reserve(void) {
+  if (! atomic_load_explicit(&running, memory_order_relaxed)) {
+    return NULL;
+  }
+  if (own_ring == NULL && (own_ring = access_log_register()) == NULL) {
+    return NULL;
+  }
+
+  struct access_log_ring* ring = own_ring;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == ACCESS_LOG_RING_SIZE) {
+    access_log_wake();
+    if (log_policy == ACCESS_LOG_DROP || ! atomic_load_explicit(&running, memory_order_relaxed)) {
+      atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+      return NULL;
+    }
+    struct timespec pause = { 0, 100 * 1000 };
+    nanosleep(&pause, NULL);
+  }
+  return &ring->records[head & (ACCESS_LOG_RING_SIZE - 1)];
+}
+
+void access_log_commit(void) {
+  struct access_log_ring* ring = own_ring;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+
+  // the logger wakes up on its own every ACCESS_LOG_FLUSH_MS, only hurry
+  // it when the ring is filling up
+  if (head - atomic_load_explicit(&ring->tail, memory_order_relaxed) >= ACCESS_LOG_RING_SIZE / 2) {
+    access_log_wake();
+  }
+}
+
+static void access_log_write(const char* buff, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(log_fd, buff, len);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("access log write");
+      return;
+    }
+    buff += written;
+    len -= written;
+  }
+}
+
+// Formats and writes out everything committed so far, returns the number
+// of records written.
+static size_t access_log_drain(void) {
+  static char batch[ACCESS_LOG_BATCH];
+  size_t batch_len = 0;
+  size_t count = 0;
+  char time_buff[TIMESTAMP_LOG_LEN + 1];
+  char client[INET6_ADDRSTRLEN];
+
+  int n = atomic_load_explicit(&nb_rings, memory_order_acquire);
+  for (int i = 0; i < n; i++) {
+    struct access_log_ring* ring = rings[i];
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+      const struct access_log_record* rec = &ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+      if (sizeof(batch) - batch_len < ACCESS_LOG_LINE_MAX) {
+        // the records are copied out, their slots can be reused
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        access_log_write(batch, batch_len);
+        batch_len = 0;
+      }
+      timestamp_log(rec->time, time_buff);
+      if (rec->client_family == AF_UNSPEC || inet_ntop(rec->client_family, rec->client, client, sizeof(client)) == NULL) {
+        strcpy(client, "-");
+      }
+      batch_len += snprintf(batch + batch_len, sizeof(batch) - batch_len, "%s - [%s] \"%d %.*s %.*s\" %s %zu\n",
+                            client, time_buff, rec->verb, (int) rec->path_len, rec->path,
+                            (int) rec->version_len, rec->version, rec->status, rec->response_len);
+      count++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    size_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+      fprintf(stderr, "access log: %zu records dropped\n", dropped);
+    }
+  }
+
+  access_log_write(batch, batch_len);
+  return count;
+}
+
+static void* access_log_run(void* arg) {
+  while (1) {
+    bool stop = atomic_load(&stopping);
+    size_t count = access_log_drain();
+    if (stop) {
+      // until a pass finds nothing left
+      if (count == 0) {
+        break;
+      }
+      continue;
+    }
+
+    uint32_t seq = atomic_load(&wakeup);
+    atomic_store(&sleeping, true);
+    struct timespec timeout = { 0, ACCESS_LOG_FLUSH_MS * 1000000L };
+    syscall(SYS_futex, (uint32_t*) &wakeup, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+    atomic_store(&sleeping, false);
+  }
+  return NULL;
+}
+
+bool access_log_start(int fd, enum access_log_policy policy) {
+  log_fd = fd;
+  log_policy = policy;
+  atomic_store(&running, true);
+  int err = pthread_create(&logger, NULL, access_log_run, NULL);
+  if (err != 0) {
+    atomic_store(&running, false);
+    errno = err;
+    perror("access log thread");
+    return false;
+  }
+  return true;
+}
+
+void access_log_stop(void) {
+  if (! atomic_load(&running)) {
+    return;
+  }
+  // no new records, the logger writes out the ones already there
+  atomic_store(&running, false);
+  atomic_store(&stopping, true);
+  atomic_fetch_add(&wakeup, 1);
+  syscall(SYS_futex, (uint32_t*) &wakeup, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  pthread_join(logger, NULL);
+}
@@ -0,0 +1,49 @@
+#ifndef ACCESS_LOG_HEADER
+#define ACCESS_LOG_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define ACCESS_LOG_RING_SIZE 1024 // records per thread, power of 2
+#define ACCESS_LOG_MAX_THREADS 128
+#define ACCESS_LOG_FLUSH_MS 100
+#define ACCESS_LOG_BATCH (64 * 1024) // bytes formatted per write
+#define ACCESS_LOG_PATH_MAX 256
+#define ACCESS_LOG_VERSION_MAX 16
+
+// What to do with a record when the logger falls behind and the ring of
+// the thread is full.
+enum access_log_policy {
+  ACCESS_LOG_DROP,  // count it as dropped, the logger reports how many
+  ACCESS_LOG_BLOCK  // wait for the logger to make room
+};
+
+// One request, as copied by the thread serving it. Formatting, the client
+// address included, is left to the logger thread. Longer strings are
+// truncated.
+struct access_log_record {
+  time_t time;
+  const char* status; // static string
+  size_t response_len;
+  int verb;
+  unsigned short path_len;
+  unsigned char version_len;
+  unsigned char client_family; // AF_INET, AF_INET6 or AF_UNSPEC when unknown
+  unsigned char client[16];    // address, network byte order
+  char path[ACCESS_LOG_PATH_MAX];
+  char version[ACCESS_LOG_VERSION_MAX];
+};
+
+// Starts the logger thread, writing to fd.
+bool access_log_start(int fd, enum access_log_policy policy);
+// Writes out every record already committed, then stops the logger.
+void access_log_stop(void);
+
+// Each thread fills its own ring, without locks: a reserved record must be
+// committed before the next one is reserved. Returns NULL when the record
+// is dropped.
+struct access_log_record* access_log_reserve(void);
+void access_log_commit(void);
+
+#endif
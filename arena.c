@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+#include "arena.h"
+
+struct arena_chunk {
+  struct arena_chunk* next;
+  size_t size;
+  size_t used;
+  alignas(ARENA_ALIGN) char data[];
+};
+
+static size_t arena_align(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+void arena_init(struct arena* arena, size_t limit) {
+  arena->head = NULL;
+  arena->allocated = 0;
+  arena->limit = limit;
+}
+
+void arena_release(struct arena* arena) {
+  struct arena_chunk* chunk = arena->head;
+  while (chunk != NULL) {
+    struct arena_chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->head = NULL;
+  arena->allocated = 0;
+}
+
+void arena_reset(struct arena* arena) {
+  struct arena_chunk* chunk = arena->head;
+  if (chunk == NULL || (chunk->next == NULL && chunk->size == ARENA_CHUNK_SIZE)) {
+    if (chunk != NULL) {
+      chunk->used = 0;
+    }
+    return;
+  }
+
+  // only a regular chunk is worth keeping, big ones are rare
+  struct arena_chunk* first = NULL;
+  while (chunk != NULL) {
+    struct arena_chunk* next = chunk->next;
+    if (next == NULL && chunk->size == ARENA_CHUNK_SIZE) {
+      first = chunk;
+    } else {
+      free(chunk);
+    }
+    chunk = next;
+  }
+  arena->head = first;
+  arena->allocated = 0;
+  if (first != NULL) {
+    first->used = 0;
+    arena->allocated = first->size;
+  }
+}
+
+static struct arena_chunk* arena_add_chunk(struct arena* arena, size_t min_size) {
+  size_t size = min_size > ARENA_CHUNK_SIZE ? min_size : ARENA_CHUNK_SIZE;
+  if (arena->allocated + size > arena->limit) {
+    return NULL;
+  }
+  struct arena_chunk* chunk = malloc(sizeof(*chunk) + size);
+  if (chunk == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  chunk->next = arena->head;
+  chunk->size = size;
+  chunk->used = 0;
+  arena->head = chunk;
+  arena->allocated += size;
+  return chunk;
+}
+
+void* arena_alloc(struct arena* arena, size_t size) {
+  size = arena_align(size);
+  struct arena_chunk* chunk = arena->head;
+  if (chunk == NULL || chunk->size - chunk->used < size) {
+    chunk = arena_add_chunk(arena, size);
+    if (chunk == NULL) {
+      return NULL;
+    }
+  }
+  void* ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+void* arena_grow(struct arena* arena, void* ptr, size_t old_size, size_t new_size) {
+  struct arena_chunk* chunk = arena->head;
+  size_t old_aligned = arena_align(old_size);
+  size_t new_aligned = arena_align(new_size);
+  if (ptr != NULL && chunk != NULL && (char*) ptr + old_aligned == chunk->data + chunk->used
+      && chunk->size - chunk->used + old_aligned >= new_aligned) {
+    chunk->used = chunk->used - old_aligned + new_aligned;
+    return ptr;
+  }
+
+  void* grown = arena_alloc(arena, new_size);
+  if (grown != NULL && old_size > 0) {
+    memcpy(grown, ptr, old_size);
+  }
+  return grown;
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_HEADER
+#define ARENA_HEADER
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE 4096 // bigger allocations get a chunk of their own
+#define ARENA_ALIGN 16
+
+struct arena_chunk;
+
+// Bump allocator: memory is handed out from chunks, nothing is freed
+// until the whole arena is reset.
+struct arena {
+  struct arena_chunk* head; // chunk being filled, the older ones follow
+  size_t allocated;         // bytes in all the chunks
+  size_t limit;             // allocated never goes past it
+};
+
+void arena_init(struct arena* arena, size_t limit);
+// Frees everything. The arena can be used again.
+void arena_release(struct arena* arena);
+// Forgets every allocation, the first chunk is kept for the next ones.
+void arena_reset(struct arena* arena);
+
+// NULL past the limit.
+void* arena_alloc(struct arena* arena, size_t size);
+// Grows ptr, old_size bytes allocated from the arena, to new_size. In place
+// when it is the last allocation and its chunk has room, otherwise it is
+// copied. NULL past the limit, ptr is then left as it is.
+void* arena_grow(struct arena* arena, void* ptr, size_t old_size, size_t new_size);
+
+#endif
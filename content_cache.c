@@ -0,0 +1,205 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "content_cache.h"
+
+#define CONTENT_CACHE_BUCKETS 256 // per shard, power of 2
+
+// Files are spread over shards by path hash. Hits only take the shard lock
+// for reading and mark the entry: evicting goes around the entries like a
+// clock hand, sparing those hit since its last pass.
+struct content_cache_shard {
+  pthread_rwlock_t lock;
+  struct content_cache_entry* buckets[CONTENT_CACHE_BUCKETS];
+  struct content_cache_entry* hand; // next eviction candidate
+  size_t bytes;
+};
+
+static struct content_cache_shard shards[CONTENT_CACHE_SHARDS];
+static size_t budget_per_shard;
+
+void content_cache_init(size_t budget) {
+  for (int i = 0; i < CONTENT_CACHE_SHARDS; i++) {
+    pthread_rwlock_init(&shards[i].lock, NULL);
+  }
+  budget_per_shard = budget / CONTENT_CACHE_SHARDS;
+}
+
+static unsigned int content_cache_hash(const char* path) {
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (; *path != '\0'; path++) {
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
+  }
+  return hash;
+}
+
+static bool content_cache_same_file(const struct stat* a, const struct stat* b) {
+  return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size
+    && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static struct content_cache_entry** content_cache_find(struct content_cache_shard* shard, const char* path, unsigned int hash) {
+  struct content_cache_entry** link = &shard->buckets[hash & (CONTENT_CACHE_BUCKETS - 1)];
+  while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->path, path) != 0)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Takes the entry out of the shard, the caller then drops the cache
+// reference with content_cache_release, out of the lock.
+static void content_cache_detach(struct content_cache_shard* shard, struct content_cache_entry* entry) {
+  struct content_cache_entry** link = content_cache_find(shard, entry->path, entry->hash);
+  *link = entry->next;
+
+  if (entry->clock_next == entry) {
+    shard->hand = NULL;
+  } else {
+    entry->clock_prev->clock_next = entry->clock_next;
+    entry->clock_next->clock_prev = entry->clock_prev;
+    if (shard->hand == entry) {
+      shard->hand = entry->clock_next;
+    }
+  }
+  shard->bytes -= entry->size;
+}
+
+struct content_cache_entry* content_cache_lookup(const char* path, const struct stat* st) {
+  if (budget_per_shard == 0) {
+    return NULL;
+  }
+
+  unsigned int hash = content_cache_hash(path);
+  struct content_cache_shard* shard = &shards[hash & (CONTENT_CACHE_SHARDS - 1)];
+
+  pthread_rwlock_rdlock(&shard->lock);
+  struct content_cache_entry* entry = *content_cache_find(shard, path, hash);
+  if (entry != NULL && content_cache_same_file(&entry->st, st)) {
+    atomic_fetch_add(&entry->refs, 1);
+    atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+  } else {
+    // a changed file is replaced by the next load
+    entry = NULL;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return entry;
+}
+
+// An entry with room for size bytes of data, right after it
+static struct content_cache_entry* content_cache_new(const char* path, size_t size, const struct stat* st) {
+  struct content_cache_entry* entry = malloc(sizeof(struct content_cache_entry) + size);
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->path = strdup(path);
+  if (entry->path == NULL) {
+    free(entry);
+    return NULL;
+  }
+  entry->data = (char*) (entry + 1);
+  entry->size = size;
+  entry->st = *st;
+  entry->hash = content_cache_hash(path);
+  atomic_init(&entry->refs, 1);
+  atomic_init(&entry->referenced, false);
+  entry->next = NULL;
+  entry->clock_prev = entry->clock_next = entry;
+  return entry;
+}
+
+// Caches a new entry, replacing the one with the same path if any
+static struct content_cache_entry* content_cache_insert(struct content_cache_entry* entry) {
+  const char* path = entry->path;
+  size_t size = entry->size;
+  if (size > budget_per_shard) {
+    return entry;
+  }
+
+  struct content_cache_shard* shard = &shards[entry->hash & (CONTENT_CACHE_SHARDS - 1)];
+  struct content_cache_entry* evicted = NULL;
+
+  pthread_rwlock_wrlock(&shard->lock);
+  struct content_cache_entry* other = *content_cache_find(shard, path, entry->hash);
+  if (other != NULL) {
+    content_cache_detach(shard, other);
+    other->next = evicted;
+    evicted = other;
+  }
+  while (shard->bytes + size > budget_per_shard) {
+    struct content_cache_entry* victim = shard->hand;
+    if (atomic_exchange_explicit(&victim->referenced, false, memory_order_relaxed)) {
+      shard->hand = victim->clock_next;
+      continue;
+    }
+    content_cache_detach(shard, victim);
+    victim->next = evicted;
+    evicted = victim;
+  }
+
+  struct content_cache_entry** bucket = &shard->buckets[entry->hash & (CONTENT_CACHE_BUCKETS - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  // behind the hand: the last one it will reach
+  if (shard->hand == NULL) {
+    shard->hand = entry;
+  } else {
+    entry->clock_next = shard->hand;
+    entry->clock_prev = shard->hand->clock_prev;
+    entry->clock_prev->clock_next = entry;
+    shard->hand->clock_prev = entry;
+  }
+  shard->bytes += size;
+  atomic_fetch_add(&entry->refs, 1);
+  pthread_rwlock_unlock(&shard->lock);
+
+  while (evicted != NULL) {
+    struct content_cache_entry* next = evicted->next;
+    content_cache_release(evicted);
+    evicted = next;
+  }
+  return entry;
+}
+
+struct content_cache_entry* content_cache_load(const char* path, int fd, const struct stat* st) {
+  struct content_cache_entry* entry = content_cache_new(path, st->st_size, st);
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  char* data = (char*) entry->data;
+  for (size_t done = 0; done < entry->size; ) {
+    ssize_t n = pread(fd, data + done, entry->size - done, done);
+    if (n <= 0) {
+      // shrunk since st was taken, the next stat will tell
+      if (n == 0) {
+        errno = EIO;
+      }
+      content_cache_release(entry);
+      return NULL;
+    }
+    done += n;
+  }
+  return content_cache_insert(entry);
+}
+
+struct content_cache_entry* content_cache_store(const char* key, const char* data, size_t size, const struct stat* st) {
+  struct content_cache_entry* entry = content_cache_new(key, size, st);
+  if (entry == NULL) {
+    return NULL;
+  }
+  memcpy((char*) entry->data, data, size);
+  return content_cache_insert(entry);
+}
+
+void content_cache_release(struct content_cache_entry* entry) {
+  if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+    free(entry->path);
+    free(entry);
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef CONTENT_CACHE_HEADER
+#define CONTENT_CACHE_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#define CONTENT_CACHE_SHARDS 16 // power of 2
+#define CONTENT_CACHE_DEFAULT_MB 64
+
+// The content of a small file, shared by all the responses serving it.
+struct content_cache_entry {
+  const char* data;
+  size_t size;
+  struct stat st;
+
+  // private
+  char* path;
+  unsigned int hash;
+  atomic_uint refs;     // one per user, plus one while in the cache
+  atomic_bool referenced; // hit since the clock hand last passed
+  struct content_cache_entry* next; // hash chain
+  struct content_cache_entry* clock_prev;
+  struct content_cache_entry* clock_next;
+};
+
+// Keeps file contents up to budget bytes in total, 0 to disable the cache.
+void content_cache_init(size_t budget);
+
+// Returns the cached content of path (or key) if st, a fresh stat of it, says it
+// did not change since it was read. NULL otherwise.
+struct content_cache_entry* content_cache_lookup(const char* path, const struct stat* st);
+// Reads the st->st_size bytes of the file open as fd and caches them.
+// NULL with errno set on failure. The entry may not be cached if it does
+// not fit, it is then freed on release.
+struct content_cache_entry* content_cache_load(const char* path, int fd, const struct stat* st);
+// Caches data derived from the file st describes, under key, a path or
+// anything else that cannot collide with one.
+struct content_cache_entry* content_cache_store(const char* key, const char* data, size_t size, const struct stat* st);
+void content_cache_release(struct content_cache_entry* entry);
+
+#endif
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "event_loop.h"
+#include "http.h"
+
+static int event_loop_epoll_init(struct event_loop* loop) {
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  // level triggered so a loop leaving connections in the backlog gets
+  // woken up again, exclusive so only one loop wakes up per connection
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLEXCLUSIVE,
+    .data.ptr = loop
+  };
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) == -1) {
+    perror("epoll_ctl(listen_fd)");
+    close(loop->epoll_fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+struct event_loop* event_loop_create(int id, int listen_fd, enum event_loop_backend backend) {
+  struct event_loop* loop = calloc(1, sizeof(struct event_loop));
+  if (loop == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  loop->id = id;
+  loop->listen_fd = listen_fd;
+  loop->epoll_fd = -1;
+
+  if (backend == EVENT_LOOP_IO_URING) {
+    if (event_loop_uring_init(loop) == 0) {
+      loop->backend = EVENT_LOOP_IO_URING;
+      return loop;
+    }
+    fprintf(stderr, "event loop %d: io_uring unavailable, falling back to epoll\n", id);
+  }
+
+  loop->backend = EVENT_LOOP_EPOLL;
+  if (event_loop_epoll_init(loop) == -1) {
+    free(loop);
+    return NULL;
+  }
+  pool_init(&loop->connections, sizeof(struct HTTP_Connection));
+
+  return loop;
+}
+
+void event_loop_destroy(struct event_loop* loop) {
+  if (loop->backend == EVENT_LOOP_IO_URING) {
+    event_loop_uring_destroy(loop);
+  } else {
+    close(loop->epoll_fd);
+  }
+  pool_destroy(&loop->connections);
+  free(loop);
+}
+
+static unsigned long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void event_loop_idle_unlink(struct event_loop* loop, struct HTTP_Connection* conn) {
+  struct event_loop_list* list = conn->sending ? &loop->sending : &loop->idle;
+  if (conn->idle_prev != NULL) {
+    conn->idle_prev->idle_next = conn->idle_next;
+  } else if (list->head == conn) {
+    list->head = conn->idle_next;
+  }
+  if (conn->idle_next != NULL) {
+    conn->idle_next->idle_prev = conn->idle_prev;
+  } else if (list->tail == conn) {
+    list->tail = conn->idle_prev;
+  }
+  conn->idle_prev = conn->idle_next = NULL;
+}
+
+void event_loop_touch(struct event_loop* loop, struct HTTP_Connection* conn) {
+  event_loop_idle_unlink(loop, conn);
+  conn->last_activity_ms = now_ms();
+  // a slow reader is not idle, only stalled ones are dropped
+  conn->sending = conn->state != HTTP_CONN_READ_REQUEST;
+  struct event_loop_list* list = conn->sending ? &loop->sending : &loop->idle;
+  conn->idle_prev = list->tail;
+  if (list->tail != NULL) {
+    list->tail->idle_next = conn;
+  } else {
+    list->head = conn;
+  }
+  list->tail = conn;
+}
+
+static void event_loop_close_connection(struct event_loop* loop, struct HTTP_Connection* conn) {
+  event_loop_idle_unlink(loop, conn);
+  http_connection_release(conn);
+  close(conn->client_fd);
+  pool_put(&loop->connections, conn);
+}
+
+static void event_loop_process(struct event_loop* loop, struct HTTP_Connection* conn) {
+  if (http_connection_process(conn) == HTTP_IO_CLOSE) {
+    // closing the fd also removes it from the epoll set
+    event_loop_close_connection(loop, conn);
+    return;
+  }
+  event_loop_touch(loop, conn);
+}
+
+// Milliseconds until the least recently active connection of the list
+// expires, -1 if there is none
+static int event_loop_expire_list(struct event_loop* loop, struct event_loop_list* list, unsigned int timeout, unsigned long long now,
+                                  void (*close_connection)(struct event_loop*, struct HTTP_Connection*)) {
+  unsigned long long timeout_ms = timeout * 1000ULL;
+
+  while (list->head != NULL) {
+    unsigned long long deadline = list->head->last_activity_ms + timeout_ms;
+    if (deadline > now) {
+      return deadline - now;
+    }
+    close_connection(loop, list->head);
+  }
+  return -1;
+}
+
+int event_loop_expire_idle(struct event_loop* loop, void (*close_connection)(struct event_loop*, struct HTTP_Connection*)) {
+  unsigned long long now = now_ms();
+  int idle = event_loop_expire_list(loop, &loop->idle, http_config.keep_alive_timeout, now, close_connection);
+  int sending = event_loop_expire_list(loop, &loop->sending, http_config.send_timeout, now, close_connection);
+  if (idle == -1 || (sending != -1 && sending < idle)) {
+    return sending;
+  }
+  return idle;
+}
+
+void event_loop_init_connection(struct HTTP_Connection* conn, int client_fd, const struct sockaddr* client_addr, socklen_t client_addr_len) {
+  http_connection_init(conn);
+  conn->client_fd = client_fd;
+  conn->client_addr_len = 0;
+  if (client_addr != NULL && client_addr_len <= sizeof(conn->client_addr)) {
+    memcpy(&conn->client_addr, client_addr, client_addr_len);
+    conn->client_addr_len = client_addr_len;
+  }
+  conn->sending = false;
+  conn->idle_prev = NULL;
+  conn->idle_next = NULL;
+  conn->last_activity_ms = 0;
+}
+
+static void event_loop_accept(struct event_loop* loop) {
+  for (int i = 0; i < EVENT_LOOP_ACCEPT_BATCH; i++) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    int client_fd = accept4(loop->listen_fd, (struct sockaddr*) &client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      perror("accept4");
+      return;
+    }
+
+    struct HTTP_Connection* conn = pool_get(&loop->connections);
+    if (conn == NULL) {
+      close(client_fd);
+      continue;
+    }
+    event_loop_init_connection(conn, client_fd, (struct sockaddr*) &client_addr, client_addr_len);
+
+    struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+      .data.ptr = conn
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+      perror("epoll_ctl(client_fd)");
+      event_loop_close_connection(loop, conn);
+      continue;
+    }
+
+    // the request is often already there, don't wait for the first event
+    event_loop_process(loop, conn);
+  }
+}
+
+static void event_loop_epoll_run(struct event_loop* loop) {
+  struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+  while (1) {
+    int timeout = event_loop_expire_idle(loop, event_loop_close_connection);
+    int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == loop) {
+        event_loop_accept(loop);
+        continue;
+      }
+
+      struct HTTP_Connection* conn = events[i].data.ptr;
+      if (events[i].events & EPOLLERR) {
+        event_loop_close_connection(loop, conn);
+        continue;
+      }
+      event_loop_process(loop, conn);
+    }
+  }
+}
+
+void event_loop_run(void* arg) {
+  struct event_loop* loop = arg;
+
+  // known only now: the thread pool decides which worker, so which cpu,
+  // runs the loop
+  if (loop->incoming_cpu) {
+    int cpu = sched_getcpu();
+    if (cpu == -1 || setsockopt(loop->listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+      perror("setsockopt(SO_INCOMING_CPU)");
+  }
+
+  if (loop->backend == EVENT_LOOP_IO_URING) {
+    event_loop_uring_run(loop);
+  } else {
+    event_loop_epoll_run(loop);
+  }
+}
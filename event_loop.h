@@ -0,0 +1,72 @@
+#ifndef EVENT_LOOP_HEADER
+#define EVENT_LOOP_HEADER
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include "pool.h"
+
+#define EVENT_LOOP_MAX_EVENTS 256
+#define EVENT_LOOP_ACCEPT_BATCH 64
+
+// io_uring backend sizing, per loop
+#define EVENT_LOOP_URING_ENTRIES 1024
+#define EVENT_LOOP_URING_SPLICE_CHUNK (64 * 1024) // default pipe capacity
+
+struct HTTP_Connection;
+struct uring;
+
+enum event_loop_backend {
+  EVENT_LOOP_EPOLL,
+  EVENT_LOOP_IO_URING
+};
+
+struct event_loop_list {
+  struct HTTP_Connection* head;
+  struct HTTP_Connection* tail;
+};
+
+struct event_loop {
+  int id;
+  enum event_loop_backend backend;
+  int epoll_fd;
+  struct uring* ring;
+  int listen_fd;
+  // set SO_INCOMING_CPU on listen_fd to the cpu running the loop, which
+  // only makes sense when the loop thread is pinned
+  bool incoming_cpu;
+
+  // connections ordered from least to most recently active, apart from
+  // the ones sending a response: they have a timeout of their own
+  struct event_loop_list idle;
+  struct event_loop_list sending;
+
+  // where the connections come from, only the loop thread touches it
+  struct pool connections;
+};
+
+// Creates a loop accepting connections from listen_fd. Several loops can
+// share the same listening socket, the kernel wakes only one of them per
+// incoming connection. A loop asking for io_uring falls back to epoll when
+// io_uring is not available.
+struct event_loop* event_loop_create(int id, int listen_fd, enum event_loop_backend backend);
+// Runs the loop, never returns. Signature compatible with threadpool_add.
+void event_loop_run(void* loop);
+void event_loop_destroy(struct event_loop* loop);
+
+// Shared by the backends.
+// client_addr may be NULL, the peer is then looked up when it is logged.
+void event_loop_init_connection(struct HTTP_Connection* conn, int client_fd, const struct sockaddr* client_addr, socklen_t client_addr_len);
+// Marks the connection as active, moving it to the end of the idle list,
+// or of the sending one when it is not waiting for a request.
+void event_loop_touch(struct event_loop* loop, struct HTTP_Connection* conn);
+void event_loop_idle_unlink(struct event_loop* loop, struct HTTP_Connection* conn);
+// Closes connections idle for longer than the keep-alive timeout, or the
+// send timeout for those sending a response, and returns the number of
+// milliseconds until the next one expires.
+int event_loop_expire_idle(struct event_loop* loop, void (*close_connection)(struct event_loop*, struct HTTP_Connection*));
+
+int event_loop_uring_init(struct event_loop* loop);
+void event_loop_uring_destroy(struct event_loop* loop);
+void event_loop_uring_run(struct event_loop* loop);
+
+#endif
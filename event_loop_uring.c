@@ -0,0 +1,392 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "event_loop.h"
+#include "http.h"
+#include "uring.h"
+
+// What a completion is about, stored in the low bits of its user_data,
+// the rest being the connection.
+enum uring_op {
+  URING_OP_ACCEPT = 1,
+  URING_OP_RECV,
+  URING_OP_WRITE,
+  URING_OP_SPLICE_IN,
+  URING_OP_SPLICE_OUT,
+  URING_OP_POLL_OUT
+};
+#define URING_OP_MASK 7
+
+struct uring_connection {
+  struct HTTP_Connection http; // first, idle list entries are cast back
+
+  struct iovec iov[2]; // must outlive the write request
+  struct msghdr msg;
+  // file bodies go through a pipe: file -> pipe -> socket
+  int pipe_fds[2];
+  size_t pipe_bytes; // spliced from the file, not yet to the socket
+
+  int inflight;
+  bool closing;
+  // the socket is non blocking: a splice to it fails when its buffer is
+  // full, the next one waits for room first
+  bool wait_writable;
+};
+
+static unsigned long long uring_user_data(struct uring_connection* uc, enum uring_op op) {
+  return (unsigned long long) (uintptr_t) uc | op;
+}
+
+int event_loop_uring_init(struct event_loop* loop) {
+  struct uring* ring = calloc(1, sizeof(struct uring));
+  if (ring == NULL) {
+    return -1;
+  }
+
+  int ret = uring_init(ring, EVENT_LOOP_URING_ENTRIES);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_setup: %s\n", strerror(-ret));
+    free(ring);
+    return -1;
+  }
+
+  loop->ring = ring;
+  pool_init(&loop->connections, sizeof(struct uring_connection));
+  return 0;
+}
+
+void event_loop_uring_destroy(struct event_loop* loop) {
+  uring_destroy(loop->ring);
+  free(loop->ring);
+  loop->ring = NULL;
+}
+
+static struct io_uring_sqe* uring_connection_sqe(struct event_loop* loop, struct uring_connection* uc, enum uring_op op) {
+  struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+  if (sqe == NULL) {
+    return NULL;
+  }
+  sqe->user_data = uring_user_data(uc, op);
+  uc->inflight++;
+  return sqe;
+}
+
+static void uring_arm_accept(struct event_loop* loop) {
+  struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+  if (sqe == NULL) {
+    fprintf(stderr, "event loop %d: no sqe left to accept\n", loop->id);
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  // non blocking, so splicing to a slow client waits for the socket to
+  // be writable instead of blocking an io-wq worker
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void uring_connection_free(struct event_loop* loop, struct uring_connection* uc) {
+  http_connection_release(&uc->http);
+  close(uc->http.client_fd);
+  if (uc->pipe_fds[0] != -1) {
+    close(uc->pipe_fds[0]);
+    close(uc->pipe_fds[1]);
+  }
+  pool_put(&loop->connections, uc);
+}
+
+// The connection is freed once its last request completes, shutting the
+// socket down makes the pending ones complete.
+static void uring_connection_close(struct event_loop* loop, struct uring_connection* uc) {
+  event_loop_idle_unlink(loop, &uc->http);
+  if (uc->inflight == 0) {
+    uring_connection_free(loop, uc);
+    return;
+  }
+  if (! uc->closing) {
+    uc->closing = true;
+    shutdown(uc->http.client_fd, SHUT_RDWR);
+  }
+}
+
+static void uring_close_idle(struct event_loop* loop, struct HTTP_Connection* conn) {
+  uring_connection_close(loop, (struct uring_connection*) conn);
+}
+
+static bool uring_submit_recv(struct event_loop* loop, struct uring_connection* uc) {
+  char* buff;
+  size_t space = http_connection_recv_space(&uc->http, &buff);
+
+  struct io_uring_sqe* sqe = uring_connection_sqe(loop, uc, URING_OP_RECV);
+  if (sqe == NULL) {
+    return false;
+  }
+  // straight into the receive buffer of the connection
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uc->http.client_fd;
+  sqe->addr = (unsigned long long) (uintptr_t) buff;
+  sqe->len = space;
+  return true;
+}
+
+static bool uring_submit_splice(struct event_loop* loop, struct uring_connection* uc) {
+  struct HTTP_Response* resp = &uc->http.response;
+
+  if (uc->pipe_fds[0] == -1 && pipe2(uc->pipe_fds, O_CLOEXEC) == -1) {
+    perror("pipe2");
+    uc->pipe_fds[0] = uc->pipe_fds[1] = -1;
+    return false;
+  }
+
+  size_t len = uc->pipe_bytes;
+  if (len == 0) {
+    len = resp->file_remaining;
+    if (len > EVENT_LOOP_URING_SPLICE_CHUNK) {
+      len = EVENT_LOOP_URING_SPLICE_CHUNK;
+    }
+
+    struct io_uring_sqe* sqe = uring_connection_sqe(loop, uc, URING_OP_SPLICE_IN);
+    if (sqe == NULL) {
+      return false;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = resp->file_fd;
+    sqe->splice_off_in = resp->file_offset;
+    sqe->fd = uc->pipe_fds[1];
+    sqe->off = (unsigned long long) -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    // a short read cancels the splice to the socket, what reached the
+    // pipe is then sent on its own
+    sqe->flags = IOSQE_IO_LINK;
+  }
+
+  struct io_uring_sqe* sqe = uring_connection_sqe(loop, uc, URING_OP_SPLICE_OUT);
+  if (sqe == NULL) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->splice_fd_in = uc->pipe_fds[0];
+  sqe->splice_off_in = (unsigned long long) -1;
+  sqe->fd = uc->http.client_fd;
+  sqe->off = (unsigned long long) -1;
+  sqe->len = len;
+  sqe->splice_flags = SPLICE_F_MOVE;
+  return true;
+}
+
+static bool uring_submit_poll_out(struct event_loop* loop, struct uring_connection* uc) {
+  struct io_uring_sqe* sqe = uring_connection_sqe(loop, uc, URING_OP_POLL_OUT);
+  if (sqe == NULL) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = uc->http.client_fd;
+  sqe->poll32_events = POLLOUT;
+  return true;
+}
+
+static bool uring_submit_write(struct event_loop* loop, struct uring_connection* uc, int iovcnt) {
+  struct HTTP_Connection* conn = &uc->http;
+  struct HTTP_Response* resp = &conn->response;
+
+  struct io_uring_sqe* sqe = uring_connection_sqe(loop, uc, URING_OP_WRITE);
+  if (sqe == NULL) {
+    return false;
+  }
+  // a socket operation, unlike writev it waits for room in the socket
+  // buffer even though the socket is non blocking
+  memset(&uc->msg, 0, sizeof(uc->msg));
+  uc->msg.msg_iov = uc->iov;
+  uc->msg.msg_iovlen = iovcnt;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->client_fd;
+  sqe->addr = (unsigned long long) (uintptr_t) &uc->msg;
+  sqe->len = 1;
+
+  // the file body follows the headers in the same submission. A short
+  // send only breaks the link with MSG_WAITALL, the splice is then
+  // canceled and the state machine resumes from what was sent.
+  if (conn->response_pending && resp->file_fd != -1 && resp->file_remaining > 0) {
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags = IOSQE_IO_LINK;
+    return uring_submit_splice(loop, uc);
+  }
+  return true;
+}
+
+// Queues the next I/O of the connection, once the previous ones completed.
+static void uring_connection_drive(struct event_loop* loop, struct uring_connection* uc) {
+  struct HTTP_Connection* conn = &uc->http;
+
+  if (uc->inflight > 0) {
+    return;
+  }
+  if (uc->closing) {
+    uring_connection_free(loop, uc);
+    return;
+  }
+
+  bool submitted = true;
+  while (1) {
+    switch (conn->state) {
+    case HTTP_CONN_READ_REQUEST:
+      if (http_connection_parse(conn)) {
+        continue;
+      }
+      submitted = uring_submit_recv(loop, uc);
+      break;
+    case HTTP_CONN_WRITE_HEADERS: {
+      int iovcnt = http_connection_output(conn, uc->iov);
+      if (iovcnt == 0) {
+        http_connection_output_written(conn, 0);
+        continue;
+      }
+      submitted = uring_submit_write(loop, uc, iovcnt);
+      break;
+    }
+    case HTTP_CONN_SENDFILE:
+      if (uc->wait_writable) {
+        uc->wait_writable = false;
+        submitted = uring_submit_poll_out(loop, uc);
+        break;
+      }
+      submitted = uring_submit_splice(loop, uc);
+      break;
+    case HTTP_CONN_DONE:
+      if (http_connection_response_done(conn) == HTTP_IO_CLOSE) {
+        uring_connection_close(loop, uc);
+        return;
+      }
+      continue;
+    }
+    break;
+  }
+
+  if (! submitted) {
+    uring_connection_close(loop, uc);
+    return;
+  }
+  event_loop_touch(loop, conn);
+}
+
+static void uring_handle_accept(struct event_loop* loop, struct io_uring_cqe* cqe) {
+  if (! (cqe->flags & IORING_CQE_F_MORE)) {
+    uring_arm_accept(loop);
+  }
+  if (cqe->res < 0) {
+    if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+      fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+    }
+    return;
+  }
+
+  int client_fd = cqe->res;
+  struct uring_connection* uc = pool_get(&loop->connections);
+  if (uc == NULL) {
+    close(client_fd);
+    return;
+  }
+  uc->pipe_fds[0] = uc->pipe_fds[1] = -1;
+  uc->pipe_bytes = 0;
+  uc->inflight = 0;
+  uc->closing = false;
+  uc->wait_writable = false;
+
+  // multishot accept has no room for the peer address, it is looked up
+  // when first logged
+  event_loop_init_connection(&uc->http, client_fd, NULL, 0);
+
+  uring_connection_drive(loop, uc);
+}
+
+static void uring_handle_completion(struct event_loop* loop, struct uring_connection* uc, enum uring_op op, int res) {
+  struct HTTP_Connection* conn = &uc->http;
+  uc->inflight--;
+
+  // links broken by a short or failed request come back canceled
+  bool failed = res < 0 && res != -ECANCELED;
+
+  switch (op) {
+  case URING_OP_RECV:
+    if (res > 0) {
+      http_connection_received(conn, res);
+    } else if (res == 0) {
+      failed = true;
+    }
+    break;
+  case URING_OP_WRITE:
+    if (res >= 0) {
+      http_connection_output_written(conn, res);
+    }
+    break;
+  case URING_OP_SPLICE_IN:
+    if (res == 0) {
+      // file was truncated under us, the announced length can't be honored
+      failed = true;
+    } else if (res > 0) {
+      conn->response.file_offset += res;
+      uc->pipe_bytes += res;
+    }
+    break;
+  case URING_OP_SPLICE_OUT:
+    if (res > 0) {
+      uc->pipe_bytes -= res;
+      http_connection_file_sent(conn, res);
+    } else if (res == 0) {
+      failed = true;
+    } else if (res == -EAGAIN) {
+      failed = false;
+      uc->wait_writable = true;
+    }
+    break;
+  case URING_OP_POLL_OUT:
+  case URING_OP_ACCEPT:
+    break;
+  }
+
+  if (failed && ! uc->closing) {
+    uring_connection_close(loop, uc);
+    return;
+  }
+  uring_connection_drive(loop, uc);
+}
+
+void event_loop_uring_run(struct event_loop* loop) {
+  uring_arm_accept(loop);
+
+  while (1) {
+    int timeout = event_loop_expire_idle(loop, uring_close_idle);
+    int ret = uring_submit_and_wait(loop->ring, timeout);
+    if (ret < 0 && ret != -ETIME && ret != -EBUSY) {
+      fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+      return;
+    }
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(loop->ring)) != NULL) {
+      unsigned long long user_data = cqe->user_data;
+      struct io_uring_cqe copy = *cqe;
+      uring_cqe_seen(loop->ring);
+
+      enum uring_op op = user_data & URING_OP_MASK;
+      if (op == URING_OP_ACCEPT) {
+        uring_handle_accept(loop, &copy);
+        continue;
+      }
+      struct uring_connection* uc = (struct uring_connection*) (uintptr_t) (user_data & ~(unsigned long long) URING_OP_MASK);
+      uring_handle_completion(loop, uc, op, copy.res);
+    }
+  }
+}
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "file_cache.h"
+#include "fs_watch.h"
+
+#define FILE_CACHE_BUCKETS 256 // per shard, power of 2
+#define FILE_CACHE_WATCH_BUCKETS 256 // power of 2
+// written to, unlinked (its link count changes) or renamed away
+#define FILE_CACHE_WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Files are spread over shards by path hash, each with its own lock, table
+// and least recently used list, so loops rarely contend.
+struct file_cache_shard {
+  pthread_mutex_t lock;
+  struct file_cache_entry* buckets[FILE_CACHE_BUCKETS];
+  struct file_cache_entry* lru_head; // most recently used
+  struct file_cache_entry* lru_tail;
+  size_t count;
+};
+
+static struct file_cache_shard shards[FILE_CACHE_SHARDS];
+static size_t max_per_shard;
+// Open files by wd, from when they are opened until they are closed.
+// Taken before a shard lock, never after.
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file_cache_entry* watched[FILE_CACHE_WATCH_BUCKETS];
+
+static void file_cache_on_event(const struct inotify_event* event, void* arg);
+
+void file_cache_init(size_t max_fds) {
+  for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+  max_per_shard = max_fds / FILE_CACHE_SHARDS;
+  if (max_per_shard > 0) {
+    fs_watch_listen(file_cache_on_event, NULL);
+  }
+}
+
+static unsigned int file_cache_hash(const char* path) {
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (; *path != '\0'; path++) {
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
+  }
+  return hash;
+}
+
+static bool file_cache_same_file(const struct stat* a, const struct stat* b) {
+  return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size
+    && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void file_cache_lru_unlink(struct file_cache_shard* shard, struct file_cache_entry* entry) {
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    shard->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    shard->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void file_cache_lru_push(struct file_cache_shard* shard, struct file_cache_entry* entry) {
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head != NULL) {
+    shard->lru_head->lru_prev = entry;
+  } else {
+    shard->lru_tail = entry;
+  }
+  shard->lru_head = entry;
+}
+
+// Takes the entry out of the shard, the caller then drops the cache
+// reference with file_cache_release, out of the lock.
+static void file_cache_detach(struct file_cache_shard* shard, struct file_cache_entry* entry) {
+  struct file_cache_entry** link = &shard->buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  file_cache_lru_unlink(shard, entry);
+  entry->cached = false;
+  shard->count--;
+}
+
+static struct file_cache_entry** file_cache_watched(int wd) {
+  return &watched[(unsigned int) wd & (FILE_CACHE_WATCH_BUCKETS - 1)];
+}
+
+static void file_cache_watch(struct file_cache_entry* entry) {
+  entry->wd = fs_watch_add(entry->path, FILE_CACHE_WATCH_MASK);
+  if (entry->wd == -1) {
+    // the stat given to file_cache_acquire still tells it changed
+    return;
+  }
+  pthread_mutex_lock(&watch_lock);
+  struct file_cache_entry** bucket = file_cache_watched(entry->wd);
+  entry->wd_next = *bucket;
+  *bucket = entry;
+  pthread_mutex_unlock(&watch_lock);
+}
+
+static void file_cache_unwatch(struct file_cache_entry* entry) {
+  if (entry->wd == -1) {
+    return;
+  }
+  pthread_mutex_lock(&watch_lock);
+  struct file_cache_entry** link = file_cache_watched(entry->wd);
+  while (*link != entry) {
+    link = &(*link)->wd_next;
+  }
+  *link = entry->wd_next;
+  pthread_mutex_unlock(&watch_lock);
+  fs_watch_remove(entry->wd);
+}
+
+// Under the watch lock, so the entry cannot be freed meanwhile
+static void file_cache_drop(struct file_cache_entry* entry, struct file_cache_entry** dropped) {
+  struct file_cache_shard* shard = &shards[entry->hash & (FILE_CACHE_SHARDS - 1)];
+  pthread_mutex_lock(&shard->lock);
+  if (entry->cached) {
+    file_cache_detach(shard, entry);
+    entry->next = *dropped;
+    *dropped = entry;
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Closes the files as soon as they change instead of when they are next
+// asked for, which may be never: a deleted file keeps its blocks as long
+// as it is open.
+static void file_cache_on_event(const struct inotify_event* event, void* arg) {
+  struct file_cache_entry* dropped = NULL;
+
+  pthread_mutex_lock(&watch_lock);
+  if (event->wd == -1) {
+    for (int i = 0; i < FILE_CACHE_WATCH_BUCKETS; i++) {
+      for (struct file_cache_entry* entry = watched[i]; entry != NULL; entry = entry->wd_next) {
+        file_cache_drop(entry, &dropped);
+      }
+    }
+  } else {
+    for (struct file_cache_entry* entry = *file_cache_watched(event->wd); entry != NULL; entry = entry->wd_next) {
+      if (entry->wd == event->wd) {
+        file_cache_drop(entry, &dropped);
+      }
+    }
+  }
+  pthread_mutex_unlock(&watch_lock);
+
+  while (dropped != NULL) {
+    struct file_cache_entry* next = dropped->next;
+    file_cache_release(dropped);
+    dropped = next;
+  }
+}
+
+static struct file_cache_entry* file_cache_open(const char* path, unsigned int hash) {
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct file_cache_entry* entry = calloc(1, sizeof(struct file_cache_entry));
+  if (entry == NULL || (entry->path = strdup(path)) == NULL || fstat(fd, &entry->st) == -1) {
+    int err = errno;
+    if (entry != NULL) {
+      free(entry->path);
+    }
+    free(entry);
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  entry->fd = fd;
+  entry->hash = hash;
+  entry->wd = -1;
+  atomic_init(&entry->refs, 1);
+  if (max_per_shard > 0) {
+    file_cache_watch(entry);
+  }
+  return entry;
+}
+
+struct file_cache_entry* file_cache_acquire(const char* path, const struct stat* st) {
+  unsigned int hash = file_cache_hash(path);
+  struct file_cache_shard* shard = &shards[hash & (FILE_CACHE_SHARDS - 1)];
+  struct file_cache_entry* stale = NULL;
+  struct file_cache_entry* entry;
+
+  if (max_per_shard == 0) {
+    return file_cache_open(path, hash);
+  }
+
+  pthread_mutex_lock(&shard->lock);
+  for (entry = shard->buckets[hash & (FILE_CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+      break;
+    }
+  }
+  if (entry != NULL) {
+    if (file_cache_same_file(&entry->st, st)) {
+      atomic_fetch_add(&entry->refs, 1);
+      file_cache_lru_unlink(shard, entry);
+      file_cache_lru_push(shard, entry);
+      pthread_mutex_unlock(&shard->lock);
+      return entry;
+    }
+    // replaced or modified since it was opened
+    file_cache_detach(shard, entry);
+    stale = entry;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (stale != NULL) {
+    file_cache_release(stale);
+  }
+
+  // no syscall under the lock
+  entry = file_cache_open(path, hash);
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  struct file_cache_entry* evicted = NULL;
+  pthread_mutex_lock(&shard->lock);
+  struct file_cache_entry** bucket = &shard->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+  for (struct file_cache_entry* other = *bucket; other != NULL; other = other->next) {
+    if (other->hash == hash && strcmp(other->path, path) == 0) {
+      // opened by another loop meanwhile, ours replaces it: it is the
+      // freshest and we already paid for it
+      file_cache_detach(shard, other);
+      evicted = other;
+      break;
+    }
+  }
+  if (evicted == NULL && shard->count >= max_per_shard) {
+    evicted = shard->lru_tail;
+    file_cache_detach(shard, evicted);
+  }
+  entry->next = *bucket;
+  *bucket = entry;
+  file_cache_lru_push(shard, entry);
+  entry->cached = true;
+  shard->count++;
+  atomic_fetch_add(&entry->refs, 1);
+  pthread_mutex_unlock(&shard->lock);
+
+  if (evicted != NULL) {
+    file_cache_release(evicted);
+  }
+  return entry;
+}
+
+void file_cache_release(struct file_cache_entry* entry) {
+  if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+    file_cache_unwatch(entry);
+    close(entry->fd);
+    free(entry->path);
+    free(entry);
+  }
+}
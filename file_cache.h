@@ -0,0 +1,41 @@
+#ifndef FILE_CACHE_HEADER
+#define FILE_CACHE_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_SHARDS 16 // power of 2
+#define FILE_CACHE_MAX_FDS 4096
+
+// An open file shared by all the responses serving it. The fd is only read
+// with explicit offsets (sendfile, splice), so it is safe to share.
+struct file_cache_entry {
+  int fd;
+  struct stat st;
+
+  // private
+  char* path;
+  unsigned int hash;
+  atomic_uint refs;    // one per user, plus one while in the cache
+  bool cached;
+  int wd;              // watching the file, -1 if not
+  struct file_cache_entry* next; // hash chain
+  struct file_cache_entry* wd_next;
+  struct file_cache_entry* lru_prev;
+  struct file_cache_entry* lru_next;
+};
+
+// Keeps up to max_fds files open, 0 to disable the cache. Registers an
+// fs_watch listener closing the files deleted, replaced or modified, so
+// must be called before fs_watch_start.
+void file_cache_init(size_t max_fds);
+
+// Returns the open file at path, opening it when it is not cached or when
+// st, a fresh stat of path, says it changed since. NULL with errno set if
+// it cannot be opened. Must be given back with file_cache_release.
+struct file_cache_entry* file_cache_acquire(const char* path, const struct stat* st);
+void file_cache_release(struct file_cache_entry* entry);
+
+#endif
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fs_watch.h"
+
+#define FS_WATCH_BUCKETS 256 // power of 2
+
+struct fs_watch_ref {
+  int wd;
+  unsigned int refs;
+  struct fs_watch_ref* next;
+};
+
+static int inotify_fd = -1;
+static pthread_mutex_t refs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fs_watch_ref* refs[FS_WATCH_BUCKETS];
+
+static struct {
+  fs_watch_listener listener;
+  void* arg;
+} listeners[FS_WATCH_MAX_LISTENERS];
+static int nb_listeners;
+
+bool fs_watch_listen(fs_watch_listener listener, void* arg) {
+  if (nb_listeners == FS_WATCH_MAX_LISTENERS) {
+    return false;
+  }
+  listeners[nb_listeners].listener = listener;
+  listeners[nb_listeners].arg = arg;
+  nb_listeners++;
+  return true;
+}
+
+static struct fs_watch_ref** fs_watch_find(int wd) {
+  struct fs_watch_ref** link = &refs[(unsigned int) wd & (FS_WATCH_BUCKETS - 1)];
+  while (*link != NULL && (*link)->wd != wd) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// The kernel dropped the watch, the inode is gone
+static void fs_watch_forget(int wd) {
+  pthread_mutex_lock(&refs_lock);
+  struct fs_watch_ref** link = fs_watch_find(wd);
+  struct fs_watch_ref* ref = *link;
+  if (ref != NULL) {
+    *link = ref->next;
+  }
+  pthread_mutex_unlock(&refs_lock);
+  free(ref);
+}
+
+static void fs_watch_dispatch(const struct inotify_event* event) {
+  for (int i = 0; i < nb_listeners; i++) {
+    listeners[i].listener(event, listeners[i].arg);
+  }
+}
+
+static void* fs_watch_thread(void* arg) {
+  char buff[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t len = read(inotify_fd, buff, sizeof(buff));
+    if (len == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read(inotify)");
+      // without events, nothing cached can be trusted anymore
+      struct inotify_event overflow = { .wd = -1, .mask = IN_Q_OVERFLOW };
+      fs_watch_dispatch(&overflow);
+      return NULL;
+    }
+
+    for (char* ptr = buff; ptr < buff + len; ) {
+      const struct inotify_event* event = (const struct inotify_event*) ptr;
+      fs_watch_dispatch(event);
+      // after the listeners, which may still remove their references
+      if (event->mask & IN_IGNORED) {
+        fs_watch_forget(event->wd);
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+bool fs_watch_start(void) {
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    perror("inotify_init1");
+    return false;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, fs_watch_thread, NULL) != 0) {
+    fprintf(stderr, "could not start the inotify thread\n");
+    close(inotify_fd);
+    inotify_fd = -1;
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+int fs_watch_add(const char* path, uint32_t mask) {
+  if (inotify_fd == -1) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  // under the lock, so the wd cannot be removed before it is counted. The
+  // mask of a watch shared by several users is the union of theirs.
+  pthread_mutex_lock(&refs_lock);
+  int wd = inotify_add_watch(inotify_fd, path, mask | IN_MASK_ADD);
+  if (wd == -1) {
+    pthread_mutex_unlock(&refs_lock);
+    return -1;
+  }
+
+  struct fs_watch_ref** link = fs_watch_find(wd);
+  if (*link != NULL) {
+    (*link)->refs++;
+  } else {
+    struct fs_watch_ref* ref = malloc(sizeof(struct fs_watch_ref));
+    if (ref == NULL) {
+      inotify_rm_watch(inotify_fd, wd);
+      errno = ENOMEM;
+      pthread_mutex_unlock(&refs_lock);
+      return -1;
+    }
+    ref->wd = wd;
+    ref->refs = 1;
+    ref->next = NULL;
+    *link = ref;
+  }
+  pthread_mutex_unlock(&refs_lock);
+  return wd;
+}
+
+void fs_watch_remove(int wd) {
+  if (wd == -1) {
+    return;
+  }
+
+  pthread_mutex_lock(&refs_lock);
+  struct fs_watch_ref** link = fs_watch_find(wd);
+  struct fs_watch_ref* ref = *link;
+  if (ref == NULL || --ref->refs > 0) {
+    pthread_mutex_unlock(&refs_lock);
+    return;
+  }
+  *link = ref->next;
+  inotify_rm_watch(inotify_fd, wd);
+  pthread_mutex_unlock(&refs_lock);
+  free(ref);
+}
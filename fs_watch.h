@@ -0,0 +1,28 @@
+#ifndef FS_WATCH_HEADER
+#define FS_WATCH_HEADER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+
+#define FS_WATCH_MAX_LISTENERS 4
+
+// One inotify instance shared by the caches. A thread reads its events and
+// hands each one to every listener. On queue overflow, listeners get an
+// event with wd -1: anything may have changed.
+typedef void (*fs_watch_listener)(const struct inotify_event* event, void* arg);
+
+// Listeners must be registered before fs_watch_start.
+bool fs_watch_listen(fs_watch_listener listener, void* arg);
+// Returns false when inotify is not available, the caches then only rely
+// on their own expiration.
+bool fs_watch_start(void);
+
+// Watches are reference counted: the same path, or another path to the
+// same inode, gets the same wd, and it is only removed from inotify once
+// every user removed it. Returns -1 with errno set on failure, ENOSYS
+// without inotify.
+int fs_watch_add(const char* path, uint32_t mask);
+void fs_watch_remove(int wd);
+
+#endif
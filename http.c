@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <time.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
 #include <assert.h>
 #include <dirent.h>
@@ -12,11 +13,30 @@
 #include <fcntl.h>
 
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include <zlib.h>
 
 #include "http_status_code.h"
 #include "http.h"
+#include "path_cache.h"
+#include "timestamp.h"
+#include "access_log.h"
+#include "http_parser.h"
+#include "pool.h"
+
+struct HTTP_Config http_config = {
+  .max_requests_per_connection = 100,
+  .keep_alive_timeout = 5,
+  .send_timeout = 60,
+  .small_file_max = 16 * 1024,
+  .gzip_max = 128 * 1024,
+  .request_max = 32 * 1024,
+  .arena_max = 64 * 1024
+};
 
 static int decodeURIComponent (char *sSource, char *sDest) { // https://stackoverflow.com/a/20437049
   assert(sSource != NULL);
@@ -38,37 +58,70 @@ static int decodeURIComponent (char *sSource, char *sDest) { // https://stackove
 
 #define implodeURIComponent(url) decodeURIComponent(url, url)
 
-static int http_send_status_line(struct HTTP_Connection* conn, struct HTTP_Response* resp) {
-  #define buff_size 50
-  if (resp->header_sent) {
-    fprintf(stderr, "err: http_send_status_name called after headers sent\n");
-    return -1;
-  }
-  if (resp->status_line_sent) {
-    fprintf(stderr, "err: http_send_status_name called more than one time\n");
-    return -1;    
+// Status lines are formatted once, responses point to them
+static char http_status_lines[HTTPSC_LAST_VALUE][HTTP_STATUS_LINE_MAX_LEN];
+static size_t http_status_line_lens[HTTPSC_LAST_VALUE];
+
+// Headers every response starts with, rebuilt by each thread when the
+// date changes
+#define HTTP_COMMON_HEADERS_PREFIX "Server: http_server" HTTP_ENDL "Date: "
+static __thread char http_common_headers[] = HTTP_COMMON_HEADERS_PREFIX "Thu, 01 Jan 1970 00:00:00 GMT" HTTP_ENDL;
+
+void http_init(void) {
+  http_parser_init();
+  for (int i = 0; i < HTTPSC_LAST_VALUE; i++) {
+    struct http_status_code_s code = http_status_codes[i];
+    int n = snprintf(http_status_lines[i], HTTP_STATUS_LINE_MAX_LEN, "HTTP/1.1 %s %s" HTTP_ENDL, code.scode, code.text);
+    if (n < 0 || n >= HTTP_STATUS_LINE_MAX_LEN) {
+      fprintf(stderr, "err: status line too long for %s\n", code.scode);
+      n = 0;
+    }
+    http_status_line_lens[i] = n;
   }
+}
 
-  char buff[buff_size] = {0};
-
+static int http_format_status_line(struct HTTP_Response* resp) {
   assert(resp->response_code < HTTPSC_LAST_VALUE);
-  struct http_status_code_s code = http_status_codes[resp->response_code];
-  
-  size_t buff_n = snprintf(buff, buff_size, "HTTP/1.1 %s %s" HTTP_ENDL, code.scode, code.text);
+  if (http_status_line_lens[resp->response_code] == 0) {
+    return -1;
+  }
+  resp->status_line = http_status_lines[resp->response_code];
+  resp->status_line_len = http_status_line_lens[resp->response_code];
+  return 0;
+}
 
-  ssize_t ret = send(conn->client_fd, buff, buff_n, MSG_MORE);
-  if (ret == -1) {
-    perror("send");
+// Makes room for len more bytes in the header block
+static int http_header_reserve(struct HTTP_Response* resp, size_t len) {
+  size_t needed = resp->header_len + len;
+  if (needed <= resp->header_cap) {
+    return 0;
+  }
+  size_t cap = resp->header_cap > 0 ? resp->header_cap : HTTP_HEADER_BLOCK_LEN;
+  while (cap < needed) {
+    cap *= 2;
+  }
+  char* header = arena_grow(resp->arena, resp->header, resp->header_cap, cap);
+  if (header == NULL) {
     return -1;
   }
+  resp->header = header;
+  resp->header_cap = cap;
+  return 0;
+}
 
+// Appends already formatted header lines
+static int http_add_raw_headers(struct HTTP_Response* resp, const char* headers, size_t len) {
+  if (resp->header_ended || http_header_reserve(resp, len) == -1) {
+    return -1;
+  }
+  memcpy(resp->header + resp->header_len, headers, len);
+  resp->header_len += len;
   return 0;
-  #undef buff_size
 }
 
 static int http_add_header(struct HTTP_Response* resp, char* name, String_View value) {
-  if (resp->header_sent) {
-    fprintf(stderr, "err: http_add_header called after headers sent: %s\n", name);
+  if (resp->header_ended) {
+    fprintf(stderr, "err: http_add_header called after headers ended: %s\n", name);
     return -1;
   }
   size_t name_len = strlen(name);
@@ -77,7 +130,7 @@ static int http_add_header(struct HTTP_Response* resp, char* name, String_View v
   }
 
   size_t header_len = name_len + sizeof(HTTP_HEADER_SEPARATOR) + value.count + sizeof(HTTP_ENDL) - 2;
-  if ((resp->header_len + header_len) > (HTTP_HEADER_MAX_LEN - sizeof(HTTP_ENDL) - 1)) {
+  if (http_header_reserve(resp, header_len) == -1) {
     return -1;
   }
 
@@ -97,259 +150,986 @@ static int http_add_header(struct HTTP_Response* resp, char* name, String_View v
   return 0;
 }
 
-static int http_send_headers(struct HTTP_Connection* conn, struct HTTP_Response* resp) {
-  if (resp->header_sent) {
+static int http_add_content_length(struct HTTP_Response* resp, size_t length) {
+  char content_size_str[20];
+  sprintf(content_size_str, "%zu", length);
+  return http_add_header(resp, "Content-Length", sv_from_cstr(content_size_str));
+}
+
+// Formats the status line and terminates the header block. Nothing is
+// written here, the connection state machine sends the response once
+// the request handling is over.
+static int http_end_headers(struct HTTP_Response* resp) {
+  if (resp->header_ended) {
     return -1;
   }
 
-  if (! resp->status_line_sent) {
-    if (http_send_status_line(conn, resp) == -1) {
-      return -1;
-    }
+  if (http_format_status_line(resp) == -1) {
+    return -1;
   }
 
-  if (resp->header_len + (sizeof(HTTP_ENDL) - 1) > HTTP_HEADER_MAX_LEN) {
+  if (http_header_reserve(resp, sizeof(HTTP_ENDL) - 1) == -1) {
     return -1;
   }
 
-  int flags = 0;
-  if (! resp->header_only) {
-    flags |= MSG_MORE;
-  }
-  
   char* buff = resp->header + resp->header_len;
   memcpy(buff, HTTP_ENDL, sizeof(HTTP_ENDL) - 1);
   resp->header_len += sizeof(HTTP_ENDL) - 1;
-  
-  ssize_t ret = send(conn->client_fd, resp->header, resp->header_len, flags);
-  if (ret == -1) {
-    perror("send");
-    return -1;
-  }
-  resp->header_sent = true;
+
+  resp->header_ended = true;
   return 0;
 }
 
 
-static bool consume_HTTP_header(String_View* svbuf, struct HTTP_Request* header) {
-  int nb_line = 0;
-  String_View line = SV_NULL;
-  bool end_of_header = false;
-
-  line = sv_chop_by_sv(svbuf, SV(HTTP_ENDL));
-  while (! sv_eq(line, SV(""))) {
-    nb_line = nb_line + 1;
-
-    if (nb_line == 1) {
-      String_View verb = sv_chop_by_delim(&line, ' ');
-      
-      if (sv_eq(verb, SV("GET"))) {
-        header->verb = GET;
-      } else if (sv_eq(verb, SV("HEAD"))) {
-        header->verb = HEAD;
-      } else if (sv_eq(verb, SV("POST"))) {
-        header->verb = POST;
-      } else if (sv_eq(verb, SV("PUT"))) {
-        header->verb = PUT;
-      } else if (sv_eq(verb, SV("DELETE"))) {
-        header->verb = DELETE;
-      } else {
-        printf("ERROR: Unsupported verb " SV_Fmt "\n", SV_Arg(verb));
-      }
+static void consume_HTTP_header(const struct http_parsed_request* parsed, struct HTTP_Request* header) {
+  if (sv_eq(parsed->method, SV("GET"))) {
+    header->verb = GET;
+  } else if (sv_eq(parsed->method, SV("HEAD"))) {
+    header->verb = HEAD;
+  } else if (sv_eq(parsed->method, SV("POST"))) {
+    header->verb = POST;
+  } else if (sv_eq(parsed->method, SV("PUT"))) {
+    header->verb = PUT;
+  } else if (sv_eq(parsed->method, SV("DELETE"))) {
+    header->verb = DELETE;
+  } else {
+    header->verb = UNSUPPORTED;
+  }
 
-      // TODO: check for too long path >= 65537
-      // TODO: strip extra /'/'
-      header->path = sv_chop_by_delim(&line, ' '); 
-      header->version = sv_chop_by_delim(&line, ' '); // TODO: html/0 only has GET verb
-      header->path = sv_trim_right(header->path); // remove trailling space in case of HTTP/1.0
-    } else {
-      String_View header_key = sv_chop_by_sv(&line, SV(": "));
-      String_View header_value = line;
-
-      if (sv_eq_ignorecase(header_key, SV("from"))) {
-        header->hFrom = header_value;
-      } else if (sv_eq_ignorecase(header_key, SV("host"))) {
-        header->hHost = header_value;
-      } else if (sv_eq_ignorecase(header_key, SV("user-agent"))) {
-        header->hUseragent = header_value;
-      } else if (sv_eq_ignorecase(header_key, SV("accept"))) {
-        header->hAccept = header_value;
-      } else if (sv_eq_ignorecase(header_key, SV("connection"))) {
-        header->hConnection = header_value;
-      } else if (sv_eq_ignorecase(header_key, SV("if-modified-since"))) {
-        header->hIfModifiedSince = header_value;
-      } else {
-        //printf("ignored header: " SV_Fmt "\n", SV_Arg(header_key));
-      }
-    }
+  // TODO: check for too long path >= 65537
+  // TODO: strip extra /'/'
+  header->path = parsed->target;
+  header->version = parsed->version;
+}
 
-    line = sv_chop_by_sv(svbuf, SV("\r\n"));
-    if (sv_starts_with(line, SV("\r\n"))) {
-      sv_chop_by_sv(svbuf, SV("\r\n"));
-      end_of_header = true;
-      break;
+// Raw address of the peer for the logger thread to format. Looked up on
+// first use when the event loop accepted without it.
+static void http_copy_client(struct HTTP_Connection* conn, struct access_log_record* rec) {
+  if (conn->client_addr_len == 0) {
+    socklen_t len = sizeof(conn->client_addr);
+    if (getpeername(conn->client_fd, (struct sockaddr*) &conn->client_addr, &len) == -1) {
+      // not asked again
+      conn->client_addr.ss_family = AF_UNSPEC;
+      len = sizeof(conn->client_addr.ss_family);
     }
+    conn->client_addr_len = len;
   }
 
-  return end_of_header;
+  if (conn->client_addr.ss_family == AF_INET) {
+    const struct sockaddr_in* in = (const struct sockaddr_in*) &conn->client_addr;
+    rec->client_family = AF_INET;
+    memcpy(rec->client, &in->sin_addr, sizeof(in->sin_addr));
+  } else if (conn->client_addr.ss_family == AF_INET6) {
+    const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) &conn->client_addr;
+    rec->client_family = AF_INET6;
+    memcpy(rec->client, &in6->sin6_addr, sizeof(in6->sin6_addr));
+  } else {
+    rec->client_family = AF_UNSPEC;
+  }
 }
 
 static void apache2_log_response(struct HTTP_Connection* conn, struct HTTP_Request* req, struct HTTP_Response* resp) {
-  time_t timestamp = time(NULL);
-  struct tm * now = localtime(&timestamp);
-  char time_buff[30];
-  strftime(time_buff, 29, "%d/%b/%Y:%H:%M:%S %z", now);
-
   assert(resp->response_code < HTTPSC_LAST_VALUE);
-  struct http_status_code_s code = http_status_codes[resp->response_code];
-  
-  printf("%s - [%s] \"%d " SV_Fmt " " SV_Fmt "\" %s %zu\n", conn->hbuf, time_buff, req->verb, SV_Arg(req->path), SV_Arg(req->version), code.scode, resp->response_len);
+
+  // formatted and written by the logger thread
+  struct access_log_record* rec = access_log_reserve();
+  if (rec == NULL) {
+    return;
+  }
+  rec->time = time(NULL);
+  rec->status = http_status_codes[resp->response_code].scode;
+  rec->response_len = resp->response_len;
+  rec->verb = req->verb;
+  http_copy_client(conn, rec);
+  rec->path_len = req->path.count < sizeof(rec->path) ? req->path.count : sizeof(rec->path);
+  memcpy(rec->path, req->path.data, rec->path_len);
+  rec->version_len = req->version.count < sizeof(rec->version) ? req->version.count : sizeof(rec->version);
+  memcpy(rec->version, req->version.data, rec->version_len);
+  access_log_commit();
 }
 
 static void http_send_error(struct HTTP_Connection* conn, struct HTTP_Response* resp) {
+  assert(resp->response_code < HTTPSC_LAST_VALUE);
+  struct http_status_code_s code = http_status_codes[resp->response_code];
+
   http_add_header(resp, "Content-Type", SV("text/plain"));
-  resp->header_only = false;
-  if (http_send_headers(conn, resp) == -1) {
+  http_add_content_length(resp, strlen(code.text));
+  if (http_end_headers(resp) == -1) {
     fprintf(stderr, "Error: http_send_error did not complete successfully\n");
     return;
   }
 
-  assert(resp->response_code < HTTPSC_LAST_VALUE);
-  struct http_status_code_s code = http_status_codes[resp->response_code];
+  resp->body = code.text;
+  resp->body_len = strlen(code.text);
+}
 
-  ssize_t s = send(conn->client_fd, code.text, strlen(code.text), 0);
-  if (s == -1) {
-    fprintf(stderr, "Error: http_send_error send\n");
-    return;
+// Quality the client gives to a content coding in its Accept-Encoding
+// header, in thousandths. Codings it does not list are not acceptable,
+// unless it lists "*"; identity always is, unless excluded.
+static int http_coding_quality(String_View accept, String_View coding) {
+  bool is_identity = sv_eq(coding, SV("identity"));
+  int star = is_identity ? 1000 : 0;
+
+  while (accept.count > 0) {
+    String_View element = sv_trim(sv_chop_by_delim(&accept, ','));
+    String_View name = sv_trim(sv_chop_by_delim(&element, ';'));
+    int quality = 1000;
+    while (element.count > 0) {
+      String_View param = sv_trim(sv_chop_by_delim(&element, ';'));
+      if (param.count >= 2 && (param.data[0] == 'q' || param.data[0] == 'Q') && param.data[1] == '=') {
+        // 0, 1, 0.5, 0.125 or 1.000
+        quality = (param.count > 2 && param.data[2] == '1') ? 1000 : 0;
+        int scale = 100;
+        for (size_t i = 4; i < param.count && i < 7 && isdigit(param.data[i]); i++, scale /= 10) {
+          quality += (param.data[i] - '0') * scale;
+        }
+        if (quality > 1000) {
+          quality = 1000;
+        }
+      }
+    }
+    if (sv_eq_ignorecase(name, coding)) {
+      return quality;
+    }
+    if (sv_eq(name, SV("*"))) {
+      star = quality;
+    }
   }
-  resp->response_len = s;
+  return star;
 }
 
-static int send_file(const int clientfd, const char* path, ssize_t size) {
-  int filefd = open(path, O_RDONLY | O_NOFOLLOW | O_NOATIME);
-  if (filefd == -1) {
-    perror("open");
+// Precompressed variants looked for next to a file, by order of preference
+// when the client likes several of them as much.
+static const struct {
+  const char* coding;
+  const char* suffix;
+} http_sidecars[] = {
+  { "br", ".br" },
+  { "zstd", ".zst" },
+  { "gzip", ".gz" },
+};
+
+// Finds the best precompressed variant of the file at request_path that
+// the client accepts, if any. It has to be a regular file in the served
+// directory at least as recent as the file itself.
+static const char* http_find_sidecar(struct HTTP_Request* req, const char* request_path, const struct stat* filestat, struct path_resolution* sidecar) {
+  if (req->headers->value[HTTP_H_ACCEPT_ENCODING].count == 0) {
+    return NULL;
+  }
+
+  size_t path_len = strlen(request_path);
+  char sidecar_path[PATH_MAX];
+  const char* best = NULL;
+  // identity wins over codings it is preferred to
+  int best_quality = http_coding_quality(req->headers->value[HTTP_H_ACCEPT_ENCODING], SV("identity"));
+
+  for (size_t i = 0; i < sizeof(http_sidecars) / sizeof(http_sidecars[0]); i++) {
+    int quality = http_coding_quality(req->headers->value[HTTP_H_ACCEPT_ENCODING], sv_from_cstr(http_sidecars[i].coding));
+    if (quality == 0 || quality < best_quality || (best != NULL && quality == best_quality)) {
+      continue;
+    }
+    size_t suffix_len = strlen(http_sidecars[i].suffix);
+    if (path_len + suffix_len >= sizeof(sidecar_path)) {
+      continue;
+    }
+    memcpy(sidecar_path, request_path, path_len);
+    memcpy(sidecar_path + path_len, http_sidecars[i].suffix, suffix_len + 1);
+
+    struct path_resolution resolution;
+    path_cache_resolve(sidecar_path, &resolution);
+    if (resolution.error != 0 || ! resolution.inside_root || ! S_ISREG(resolution.st.st_mode)) {
+      continue;
+    }
+    if (resolution.st.st_mtim.tv_sec < filestat->st_mtim.tv_sec
+        || (resolution.st.st_mtim.tv_sec == filestat->st_mtim.tv_sec && resolution.st.st_mtim.tv_nsec < filestat->st_mtim.tv_nsec)) {
+      // left behind by an update of the file
+      continue;
+    }
+    *sidecar = resolution;
+    best = http_sidecars[i].coding;
+    best_quality = quality;
   }
+  return best;
+}
+
+// Content types by file extension. Only text-like types are worth
+// compressing, the others are compressed already.
+static const struct {
+  const char* extension;
+  const char* type;
+  bool compressible;
+} http_mime_types[] = {
+  { "html", "text/html; charset=utf-8", true },
+  { "htm", "text/html; charset=utf-8", true },
+  { "css", "text/css", true },
+  { "js", "text/javascript", true },
+  { "mjs", "text/javascript", true },
+  { "json", "application/json", true },
+  { "map", "application/json", true },
+  { "xml", "application/xml", true },
+  { "svg", "image/svg+xml", true },
+  { "txt", "text/plain; charset=utf-8", true },
+  { "md", "text/markdown; charset=utf-8", true },
+  { "csv", "text/csv", true },
+  { "wasm", "application/wasm", true },
+  { "ico", "image/x-icon", true },
+  { "png", "image/png", false },
+  { "jpg", "image/jpeg", false },
+  { "jpeg", "image/jpeg", false },
+  { "gif", "image/gif", false },
+  { "webp", "image/webp", false },
+  { "avif", "image/avif", false },
+  { "woff", "font/woff", false },
+  { "woff2", "font/woff2", false },
+  { "pdf", "application/pdf", false },
+  { "zip", "application/zip", false },
+  { "gz", "application/gzip", false },
+  { "mp4", "video/mp4", false },
+  { "webm", "video/webm", false },
+  { "mp3", "audio/mpeg", false },
+};
+
+// Files with an unknown extension keep being sent as text, uncompressed
+// since they may as well be binary.
+static const char* http_mime_type(const char* path, bool* compressible) {
+  const char* dot = strrchr(path, '.');
+  if (dot != NULL && strchr(dot, '/') == NULL) {
+    for (size_t i = 0; i < sizeof(http_mime_types) / sizeof(http_mime_types[0]); i++) {
+      if (strcasecmp(dot + 1, http_mime_types[i].extension) == 0) {
+        *compressible = http_mime_types[i].compressible;
+        return http_mime_types[i].type;
+      }
+    }
+  }
+  *compressible = false;
+  return "text/plain";
+}
+
+// Whether the client takes gzip at least as willingly as the raw body
+static bool http_accepts_gzip(struct HTTP_Request* req) {
+  if (req->headers->value[HTTP_H_ACCEPT_ENCODING].count == 0) {
+    return false;
+  }
+  int quality = http_coding_quality(req->headers->value[HTTP_H_ACCEPT_ENCODING], SV("gzip"));
+  return quality > 0 && quality >= http_coding_quality(req->headers->value[HTTP_H_ACCEPT_ENCODING], SV("identity"));
+}
 
-  ssize_t sent = sendfile(clientfd, filefd, NULL, size);
-  if (sent == -1) {
-    perror("sendfile");
-    close(filefd);
+// gzip of len bytes at data, in a malloc-ed buffer. Returns false when it
+// does not make the data smaller.
+static bool http_gzip(const char* data, size_t len, char** out, size_t* out_len) {
+  z_stream stream = {0};
+  // 16 + 15: gzip wrapper, biggest window
+  if (deflateInit2(&stream, HTTP_GZIP_LEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  size_t bound = deflateBound(&stream, len);
+  char* buff = malloc(bound);
+  if (buff == NULL) {
+    deflateEnd(&stream);
+    return false;
+  }
+  stream.next_in = (Bytef*) data;
+  stream.avail_in = len;
+  stream.next_out = (Bytef*) buff;
+  stream.avail_out = bound;
+  int ret = deflate(&stream, Z_FINISH);
+  size_t compressed_len = stream.total_out;
+  deflateEnd(&stream);
+
+  if (ret != Z_STREAM_END || compressed_len >= len) {
+    free(buff);
+    return false;
+  }
+  *out = buff;
+  *out_len = compressed_len;
+  return true;
+}
+
+// Opens a gzip-ed version of the file at path as the response body,
+// compressing it only once per version of the file: the result is kept
+// in the content cache under "gzip:" + path, validated by filestat. An
+// empty entry means compressing it is useless.
+static bool http_open_gzip_body(struct HTTP_Response* resp, const char* path, const struct stat* filestat) {
+  char key[PATH_MAX + 6];
+  snprintf(key, sizeof(key), "gzip:%s", path);
+
+  struct content_cache_entry* content = content_cache_lookup(key, filestat);
+  if (content == NULL) {
+    struct file_cache_entry* file = file_cache_acquire(path, filestat);
+    if (file == NULL) {
+      return false;
+    }
+    // read, not mapped: a file truncated meanwhile would be a SIGBUS
+    size_t len = file->st.st_size;
+    char* data = malloc(len);
+    size_t done = 0;
+    while (data != NULL && done < len) {
+      ssize_t n = pread(file->fd, data + done, len - done, done);
+      if (n <= 0) {
+        break;
+      }
+      done += n;
+    }
+    if (data == NULL || done < len) {
+      free(data);
+      file_cache_release(file);
+      return false;
+    }
+
+    char* compressed = NULL;
+    size_t compressed_len = 0;
+    if (http_gzip(data, len, &compressed, &compressed_len)) {
+      content = content_cache_store(key, compressed, compressed_len, &file->st);
+      free(compressed);
+    } else {
+      // remembered, not to try again
+      content = content_cache_store(key, "", 0, &file->st);
+    }
+    free(data);
+    file_cache_release(file);
+    if (content == NULL) {
+      return false;
+    }
+  }
+
+  if (content->size == 0) {
+    content_cache_release(content);
+    return false;
+  }
+  resp->content = content;
+  resp->body = content->data;
+  resp->body_len = content->size;
+  return true;
+}
+
+static void http_response_release(struct HTTP_Response* resp) {
+  if (resp->file != NULL) {
+    file_cache_release(resp->file);
+    resp->file = NULL;
+    resp->file_fd = -1;
+  }
+  if (resp->body_allocated) {
+    free((char*) resp->body);
+    resp->body = NULL;
+    resp->body_allocated = false;
+  }
+  if (resp->content != NULL) {
+    content_cache_release(resp->content);
+    resp->content = NULL;
+    resp->body = NULL;
+  }
+}
+
+// Opens the file at path, that filestat describes, as a response body:
+// small files come from memory, others from an open file. Returns false
+// with errno set on failure.
+static bool http_open_body(struct HTTP_Response* resp, const char* path, const struct stat* filestat) {
+  // small files are sent from memory along with the headers
+  if ((size_t) filestat->st_size <= http_config.small_file_max) {
+    resp->content = content_cache_lookup(path, filestat);
+  }
+
+  if (resp->content == NULL) {
+    resp->file = file_cache_acquire(path, filestat);
+    if (resp->file == NULL) {
+      return false;
+    }
+    if ((size_t) resp->file->st.st_size <= http_config.small_file_max) {
+      resp->content = content_cache_load(path, resp->file->fd, &resp->file->st);
+      if (resp->content != NULL) {
+        file_cache_release(resp->file);
+        resp->file = NULL;
+      }
+    }
+  }
+
+  if (resp->content != NULL) {
+    resp->body = resp->content->data;
+    resp->body_len = resp->content->size;
+  } else {
+    resp->file_fd = resp->file->fd;
+    resp->file_offset = 0;
+    resp->file_remaining = resp->file->st.st_size;
+  }
+  return true;
+}
+
+struct HTTP_Range {
+  off_t first;
+  off_t last; // included
+};
+
+static bool http_parse_offset(String_View sv, off_t* offset) {
+  if (sv.count == 0) {
+    return false;
+  }
+  off_t value = 0;
+  for (size_t i = 0; i < sv.count; i++) {
+    if (! isdigit((unsigned char) sv.data[i]) || value > (INT64_MAX - 9) / 10) {
+      return false;
+    }
+    value = value * 10 + (sv.data[i] - '0');
+  }
+  *offset = value;
+  return true;
+}
+
+// Parses a "bytes=" Range header for a body of size bytes. Returns the
+// number of satisfiable ranges written to ranges, 0 if none is, -1 if the
+// header is invalid or asks for too many ranges: it is then ignored and
+// the whole body sent.
+static int http_parse_ranges(String_View header, off_t size, struct HTTP_Range ranges[HTTP_MAX_RANGES]) {
+  String_View unit = sv_trim(sv_chop_by_delim(&header, '='));
+  if (! sv_eq_ignorecase(unit, SV("bytes"))) {
     return -1;
   }
-  close(filefd);
-  return sent;
+
+  int nb_ranges = 0;
+  while (header.count > 0) {
+    String_View spec = sv_trim(sv_chop_by_delim(&header, ','));
+    if (spec.count == 0) {
+      continue;
+    }
+    String_View first = sv_trim(sv_chop_by_delim(&spec, '-'));
+    String_View last = sv_trim(spec);
+    struct HTTP_Range range;
+
+    if (first.count == 0) {
+      // the last n bytes
+      off_t suffix;
+      if (! http_parse_offset(last, &suffix)) {
+        return -1;
+      }
+      if (suffix == 0 || size == 0) {
+        continue;
+      }
+      range.first = suffix < size ? size - suffix : 0;
+      range.last = size - 1;
+    } else {
+      if (! http_parse_offset(first, &range.first)) {
+        return -1;
+      }
+      if (last.count == 0) {
+        range.last = size - 1;
+      } else if (! http_parse_offset(last, &range.last) || range.last < range.first) {
+        return -1;
+      }
+      if (range.first >= size) {
+        continue;
+      }
+      if (range.last >= size) {
+        range.last = size - 1;
+      }
+    }
+
+    if (nb_ranges == HTTP_MAX_RANGES) {
+      return -1;
+    }
+    ranges[nb_ranges++] = range;
+  }
+  return nb_ranges;
 }
 
-static void http_serve_file(struct HTTP_Connection* conn, struct HTTP_Request* req, struct HTTP_Response* resp, const char* path, struct stat filestat) {
-  http_add_header(resp, "Connection", SV("Closed"));
+// Replaces the opened body by a multipart/byteranges one holding the
+// ranges, built in memory. Returns false, leaving the body alone, when it
+// would be bigger than HTTP_MULTIPART_MAX.
+static bool http_multipart_body(struct HTTP_Response* resp, const struct HTTP_Range* ranges, int nb_ranges, off_t size, const char* content_type) {
+  static const char part_header[] = HTTP_ENDL "--" HTTP_MULTIPART_BOUNDARY HTTP_ENDL "Content-Type: %s" HTTP_ENDL "Content-Range: bytes %lld-%lld/%lld" HTTP_ENDL HTTP_ENDL;
+  static const char trailer[] = HTTP_ENDL "--" HTTP_MULTIPART_BOUNDARY "--" HTTP_ENDL;
+
+  size_t len = sizeof(trailer) - 1;
+  for (int i = 0; i < nb_ranges; i++) {
+    len += snprintf(NULL, 0, part_header, content_type, (long long) ranges[i].first, (long long) ranges[i].last, (long long) size);
+    len += ranges[i].last - ranges[i].first + 1;
+    if (len > HTTP_MULTIPART_MAX) {
+      return false;
+    }
+  }
 
-  struct tm last_modified_time_from_req = {0};
-  if (req->hIfModifiedSince.count > 0) {
-    char* cread = strptime(req->hIfModifiedSince.data, "%a, %d %b %Y %H:%M:%S %Z", &last_modified_time_from_req);
-    if (cread != NULL && req->hIfModifiedSince.data + req->hIfModifiedSince.count == cread) {
-      if (filestat.st_mtim.tv_sec <= mktime(&last_modified_time_from_req) - timezone) {
-        resp->response_code = HTTPSC_NotModified;
-        resp->header_only = true;
-        http_send_headers(conn, resp);
-        return;
+  char* body = malloc(len + 1);
+  if (body == NULL) {
+    return false;
+  }
+  char* ptr = body;
+  for (int i = 0; i < nb_ranges; i++) {
+    ptr += sprintf(ptr, part_header, content_type, (long long) ranges[i].first, (long long) ranges[i].last, (long long) size);
+    size_t range_len = ranges[i].last - ranges[i].first + 1;
+    if (resp->content != NULL) {
+      memcpy(ptr, resp->content->data + ranges[i].first, range_len);
+    } else {
+      for (size_t done = 0; done < range_len; ) {
+        ssize_t n = pread(resp->file_fd, ptr + done, range_len - done, ranges[i].first + done);
+        if (n <= 0) {
+          free(body);
+          return false;
+        }
+        done += n;
       }
     }
+    ptr += range_len;
   }
+  memcpy(ptr, trailer, sizeof(trailer) - 1);
+
+  http_response_release(resp);
+  resp->file_remaining = 0;
+  resp->body = body;
+  resp->body_len = len;
+  resp->body_allocated = true;
+  return true;
+}
 
-  resp->response_code = HTTPSC_OK;
-  http_add_header(resp, "Cache-control", SV("public"));
-  http_add_header(resp, "Content-Type", SV("text/plain"));
+// Strong validator of a version of a file: a new inode, size or mtime, to
+// the nanosecond, makes a new tag. Encoded variants get the coding as a
+// suffix, they are different representations. Returns the tag, quotes
+// included.
+static String_View http_format_etag(char buff[HTTP_ETAG_MAX_LEN], const struct stat* st, const char* coding) {
+  unsigned long long mtime_ns = (unsigned long long) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+  int len = snprintf(buff, HTTP_ETAG_MAX_LEN, "\"%llx-%llx-%llx%s%s\"", (unsigned long long) st->st_ino,
+                     (unsigned long long) st->st_size, mtime_ns, coding != NULL ? "-" : "", coding != NULL ? coding : "");
+  return sv_from_parts(buff, len);
+}
 
-  struct tm * mtim = gmtime(&(filestat.st_mtim.tv_sec));
-  char content_size_str[20];
-  sprintf(content_size_str, "%zu", filestat.st_size);
-  http_add_header(resp, "Content-Length", sv_from_cstr(content_size_str));
+// Looks for the representation tagged etag in an If-None-Match header:
+// "*", or etag compared weakly as the header requires. With gzip_variant,
+// the gzip-ed version made here of the same file matches too. Returns the
+// matching tag, an empty view if none.
+static String_View http_none_match(String_View header, String_View etag, bool gzip_variant) {
+  String_View base = sv_from_parts(etag.data + 1, etag.count - 2);
+
+  while (header.count > 0) {
+    String_View tag = sv_trim(sv_chop_by_delim(&header, ','));
+    if (sv_eq(tag, SV("*"))) {
+      return etag;
+    }
+    String_View opaque = tag;
+    if (sv_starts_with(opaque, SV("W/"))) {
+      opaque = sv_from_parts(opaque.data + 2, opaque.count - 2);
+    }
+    if (opaque.count < 2 || opaque.data[0] != '"' || opaque.data[opaque.count - 1] != '"') {
+      continue;
+    }
+    opaque = sv_from_parts(opaque.data + 1, opaque.count - 2);
+    if (! sv_starts_with(opaque, base)) {
+      continue;
+    }
+    String_View suffix = sv_from_parts(opaque.data + base.count, opaque.count - base.count);
+    if (suffix.count == 0) {
+      return tag;
+    }
+    if (gzip_variant && sv_eq(suffix, SV("-gzip"))) {
+      return tag;
+    }
+  }
+  return SV_NULL;
+}
 
+// If-Modified-Since as seconds since the epoch, -1 if invalid. Clients
+// revalidating send back the Last-Modified they got, so the same few
+// strings come again and again: each thread remembers the last one parsed.
+static time_t http_if_modified_since(String_View header) {
+  static __thread char last[HTTP_DATE_MAX_LEN];
+  static __thread size_t last_len;
+  static __thread time_t last_time;
 
-  char time_buff[40];
-  strftime(time_buff, 39, "%a, %d %b %Y %H:%M:%S %Z", mtim);
-  http_add_header(resp, "Last-Modified", sv_from_cstr(time_buff));
+  if (header.count == last_len && memcmp(header.data, last, last_len) == 0) {
+    return last_time;
+  }
+  if (header.count >= sizeof(last)) {
+    return -1;
+  }
 
-  http_send_headers(conn, resp);
-      
-  ssize_t s = send_file(conn->client_fd, path, filestat.st_size);
-  if (s == -1) {
-    return;
-  };
-  resp->response_len = s;
+  char date[HTTP_DATE_MAX_LEN];
+  memcpy(date, header.data, header.count);
+  date[header.count] = '\0';
+  struct tm tm = {0};
+  char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  time_t time = end != NULL && *end == '\0' ? timegm(&tm) : -1;
+
+  memcpy(last, date, header.count);
+  last_len = header.count;
+  last_time = time;
+  return time;
 }
 
-static void http_serve_directory(struct HTTP_Connection* conn, struct HTTP_Request* req, struct HTTP_Response* resp, const char* path, const char* web_path) {
-  struct dirent* dir_entry;
-  DIR* dir = opendir(path);
-  if (dir == NULL) {
-    perror("opendir");
-    resp->response_code = HTTPSC_InternalServerError;
+static void http_not_modified(struct HTTP_Response* resp, String_View etag) {
+  resp->response_code = HTTPSC_NotModified;
+  resp->header_only = true;
+  http_add_header(resp, "ETag", etag);
+  http_add_header(resp, "Vary", SV("Accept-Encoding"));
+  http_end_headers(resp);
+}
+
+// Header lines describing a version of a file served with a type and
+// coding: only Content-Length, and Content-Range, differ between its
+// responses. Each thread keeps the recent ones.
+struct http_file_headers {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  const char* content_type; // static strings, compared by address
+  const char* coding;
+  size_t len;
+  char text[HTTP_FILE_HEADERS_MAX_LEN];
+};
+
+static __thread struct http_file_headers http_file_headers_cache[HTTP_FILE_HEADERS_CACHE];
+
+static const struct http_file_headers* http_file_headers(const struct stat* st, const char* content_type, const char* coding) {
+  unsigned int slot = (unsigned int) st->st_ino ^ (unsigned int) st->st_mtim.tv_nsec ^ (unsigned int) ((uintptr_t) coding >> 3);
+  struct http_file_headers* headers = &http_file_headers_cache[slot & (HTTP_FILE_HEADERS_CACHE - 1)];
+  if (headers->len > 0 && headers->ino == st->st_ino && headers->dev == st->st_dev && headers->size == st->st_size
+      && headers->mtime.tv_sec == st->st_mtim.tv_sec && headers->mtime.tv_nsec == st->st_mtim.tv_nsec
+      && headers->content_type == content_type && headers->coding == coding) {
+    return headers;
+  }
+
+  char etag_buff[HTTP_ETAG_MAX_LEN];
+  String_View etag = http_format_etag(etag_buff, st, coding);
+  char last_modified[TIMESTAMP_HTTP_LEN + 1];
+  timestamp_http(st->st_mtim.tv_sec, last_modified);
+
+  // the body depends on Accept-Encoding whenever a variant may exist
+  int n = snprintf(headers->text, sizeof(headers->text),
+                   "Cache-control: public" HTTP_ENDL
+                   "Content-Type: %s" HTTP_ENDL
+                   "%s%s%s"
+                   "Vary: Accept-Encoding" HTTP_ENDL
+                   "Accept-Ranges: bytes" HTTP_ENDL
+                   "ETag: " SV_Fmt HTTP_ENDL
+                   "Last-Modified: %s" HTTP_ENDL,
+                   content_type, coding != NULL ? "Content-Encoding: " : "", coding != NULL ? coding : "",
+                   coding != NULL ? HTTP_ENDL : "", SV_Arg(etag), last_modified);
+  if (n < 0 || (size_t) n >= sizeof(headers->text)) {
+    headers->len = 0;
+    return NULL;
+  }
+
+  headers->dev = st->st_dev;
+  headers->ino = st->st_ino;
+  headers->size = st->st_size;
+  headers->mtime = st->st_mtim;
+  headers->content_type = content_type;
+  headers->coding = coding;
+  headers->len = n;
+  return headers;
+}
+
+static void http_serve_file(struct HTTP_Connection* conn, struct HTTP_Request* req, struct HTTP_Response* resp, const char* path, const char* request_path, struct stat filestat) {
+  String_View if_none_match = req->headers->value[HTTP_H_IF_NONE_MATCH];
+  String_View if_modified_since = req->headers->value[HTTP_H_IF_MODIFIED_SINCE];
+  String_View range = req->headers->value[HTTP_H_RANGE];
+  String_View if_range = req->headers->value[HTTP_H_IF_RANGE];
+
+  // validators are only formatted for conditional requests, the others
+  // get them from the headers template
+  bool conditional = if_none_match.count > 0 || if_modified_since.count > 0 || if_range.count > 0;
+  char etag_buff[HTTP_ETAG_MAX_LEN];
+  String_View etag = SV_NULL;
+  if (conditional) {
+    etag = http_format_etag(etag_buff, &filestat, NULL);
+  }
+
+  // ranges are served from the file as is, and only if it is still the
+  // version the client has part of: the same strong tag, or date
+  bool ranged = range.count > 0 && (if_range.count == 0 || sv_eq(if_range, etag));
+  if (range.count > 0 && ! ranged && if_range.count == TIMESTAMP_HTTP_LEN) {
+    char last_modified[TIMESTAMP_HTTP_LEN + 1];
+    timestamp_http(filestat.st_mtim.tv_sec, last_modified);
+    ranged = memcmp(if_range.data, last_modified, TIMESTAMP_HTTP_LEN) == 0;
+  }
+
+  // precompressed, compressed here once, or as is. A precompressed file
+  // is validated on its own: it may be regenerated without the file.
+  struct path_resolution sidecar;
+  const char* coding = ranged ? NULL : http_find_sidecar(req, request_path, &filestat, &sidecar);
+  const struct stat* served = coding != NULL ? &sidecar.st : &filestat;
+  if (coding != NULL && conditional) {
+    etag = http_format_etag(etag_buff, served, coding);
+  }
+
+  // If-Modified-Since only counts without If-None-Match
+  if (if_none_match.count > 0) {
+    String_View matching = http_none_match(if_none_match, etag, coding == NULL);
+    if (matching.count > 0) {
+      http_not_modified(resp, matching);
+      return;
+    }
+  } else if (if_modified_since.count > 0) {
+    time_t since = http_if_modified_since(if_modified_since);
+    if (since != -1 && served->st_mtim.tv_sec <= since) {
+      http_not_modified(resp, etag);
+      return;
+    }
+  }
+
+  bool compressible;
+  const char* content_type = http_mime_type(path, &compressible);
+
+  bool opened;
+  if (coding != NULL) {
+    opened = http_open_body(resp, sidecar.resolved, &sidecar.st);
+  } else if (! ranged && compressible && filestat.st_size >= HTTP_GZIP_MIN && (size_t) filestat.st_size <= http_config.gzip_max
+             && http_accepts_gzip(req) && http_open_gzip_body(resp, path, &filestat)) {
+    coding = "gzip";
+    opened = true;
+  } else {
+    opened = http_open_body(resp, path, &filestat);
+  }
+  if (! opened) {
+    perror("open");
+    resp->response_code = errno == EACCES ? HTTPSC_Forbidden : HTTPSC_InternalServerError;
     http_send_error(conn, resp);
     return;
   }
 
-  //TODO: file name encoding
+  // the file may have changed since it was stat-ed, describe what is sent
+  off_t size = resp->content != NULL ? (off_t) resp->content->size : (off_t) resp->file_remaining;
+  char content_range[80] = "";
+  const char* multipart_type = NULL;
 
   resp->response_code = HTTPSC_OK;
-  http_add_header(resp, "Cache-control", SV("no-cache"));
-  http_add_header(resp, "Content-Type", SV("text/html"));
-  http_add_header(resp, "Connection", SV("Closed"));
+  if (ranged) {
+    struct HTTP_Range ranges[HTTP_MAX_RANGES];
+    int nb_ranges = http_parse_ranges(range, size, ranges);
+
+    if (nb_ranges == 0) {
+      http_response_release(resp);
+      resp->body_len = 0;
+      resp->file_remaining = 0;
+      resp->response_code = HTTPSC_Requestedrangenotsatisfiable;
+      snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long) size);
+      http_add_header(resp, "Content-Range", sv_from_cstr(content_range));
+      http_send_error(conn, resp);
+      return;
+    }
 
-  http_send_headers(conn, resp);
+    if (nb_ranges == 1) {
+      resp->response_code = HTTPSC_PartialContent;
+      snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld", (long long) ranges[0].first, (long long) ranges[0].last, (long long) size);
+      size_t range_len = ranges[0].last - ranges[0].first + 1;
+      if (resp->content != NULL) {
+        resp->body += ranges[0].first;
+        resp->body_len = range_len;
+      } else {
+        resp->file_offset = ranges[0].first;
+        resp->file_remaining = range_len;
+      }
+    } else if (nb_ranges > 1 && http_multipart_body(resp, ranges, nb_ranges, size, content_type)) {
+      resp->response_code = HTTPSC_PartialContent;
+      multipart_type = "multipart/byteranges; boundary=" HTTP_MULTIPART_BOUNDARY;
+    }
+  }
 
-  size_t s = 0;
-  s += dprintf(conn->client_fd, "<!DOCTYPE html><html><head><meta charset=\"utf-8\"></head><body><h1>Directory listing for %s</h1><hr>", web_path);
-  while ((dir_entry = readdir(dir)) != NULL) {
-    s+= dprintf(conn->client_fd, "<a href=\"%s/%s\">%s</a><br/>", web_path, dir_entry->d_name, dir_entry->d_name); //TODO: urlencode, full path
+  const struct http_file_headers* headers = http_file_headers(served, multipart_type != NULL ? multipart_type : content_type, coding);
+  if (headers == NULL || http_add_raw_headers(resp, headers->text, headers->len) == -1) {
+    http_response_release(resp);
+    resp->body_len = 0;
+    resp->file_remaining = 0;
+    resp->response_code = HTTPSC_InternalServerError;
+    http_send_error(conn, resp);
+    return;
   }
-        
-  s += dprintf(conn->client_fd, "<hr></body></html>");
-  resp->response_len = s;
-  closedir(dir);
+  if (content_range[0] != '\0') {
+    http_add_header(resp, "Content-Range", sv_from_cstr(content_range));
+  }
+  http_add_content_length(resp, resp->content != NULL || resp->body_allocated ? resp->body_len : resp->file_remaining);
+
+  http_end_headers(resp);
 }
 
-void http_handle_connection(struct HTTP_Connection* conn) {
-  char buff[HTTP_HEADER_MAX_LEN] = {0};
+// Unreserved characters and the path separator stay as is in links
+static void http_write_url_escaped(FILE* out, const char* str) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (const unsigned char* c = (const unsigned char*) str; *c != '\0'; c++) {
+    if (isalnum(*c) || *c == '-' || *c == '.' || *c == '_' || *c == '~' || *c == '/') {
+      putc_unlocked(*c, out);
+    } else {
+      putc_unlocked('%', out);
+      putc_unlocked(hex[*c >> 4], out);
+      putc_unlocked(hex[*c & 0xf], out);
+    }
+  }
+}
 
-  int nb = recv(conn->client_fd, buff, HTTP_HEADER_MAX_LEN - 1, 0);
-  if (nb == -1) {
-    return;
+static void http_write_html_escaped(FILE* out, const char* str) {
+  for (const char* c = str; *c != '\0'; c++) {
+    switch (*c) {
+    case '&': fputs_unlocked("&amp;", out); break;
+    case '<': fputs_unlocked("&lt;", out); break;
+    case '>': fputs_unlocked("&gt;", out); break;
+    case '"': fputs_unlocked("&quot;", out); break;
+    case '\'': fputs_unlocked("&#39;", out); break;
+    default: putc_unlocked(*c, out);
+    }
+  }
+}
+
+struct http_listing_entry {
+  char* name;
+  bool directory;
+};
+
+static int http_listing_entry_cmp(const void* a, const void* b) {
+  return strcmp(((const struct http_listing_entry*) a)->name, ((const struct http_listing_entry*) b)->name);
+}
+
+// Renders the open directory as an html page, its entries sorted by name.
+static bool http_render_listing(DIR* dir, const char* web_path, char** listing, size_t* listing_len) {
+  struct http_listing_entry* entries = NULL;
+  size_t nb_entries = 0;
+  size_t capacity = 0;
+  bool ok = true;
+
+  struct dirent* dir_entry;
+  while (ok && (dir_entry = readdir(dir)) != NULL) {
+    // no way up from the root
+    if (strcmp(dir_entry->d_name, ".") == 0 || (*web_path == '\0' && strcmp(dir_entry->d_name, "..") == 0)) {
+      continue;
+    }
+    if (nb_entries == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 64;
+      struct http_listing_entry* grown = realloc(entries, capacity * sizeof(*entries));
+      if (grown == NULL) {
+        ok = false;
+        break;
+      }
+      entries = grown;
+    }
+    entries[nb_entries].name = strdup(dir_entry->d_name);
+    entries[nb_entries].directory = dir_entry->d_type == DT_DIR;
+    ok = entries[nb_entries].name != NULL;
+    nb_entries++;
+  }
+
+  FILE* out = ok ? open_memstream(listing, listing_len) : NULL;
+  if (out != NULL) {
+    qsort(entries, nb_entries, sizeof(*entries), http_listing_entry_cmp);
+
+    fputs_unlocked("<!DOCTYPE html><html><head><meta charset=\"utf-8\"></head><body><h1>Directory listing for ", out);
+    http_write_html_escaped(out, *web_path != '\0' ? web_path : "/");
+    fputs_unlocked("</h1><hr>", out);
+    for (size_t i = 0; i < nb_entries; i++) {
+      fputs_unlocked("<a href=\"", out);
+      http_write_url_escaped(out, web_path);
+      putc_unlocked('/', out);
+      http_write_url_escaped(out, entries[i].name);
+      fputs_unlocked("\">", out);
+      http_write_html_escaped(out, entries[i].name);
+      fputs_unlocked(entries[i].directory ? "/</a><br/>" : "</a><br/>", out);
+    }
+    fputs_unlocked("<hr></body></html>", out);
+    ok = fclose(out) == 0;
+  } else if (ok) {
+    perror("open_memstream");
+    ok = false;
   }
-  buff[nb + 1] = '\0';
-    
-  struct HTTP_Request request = {0};
-  struct HTTP_Response response = {0};
 
-  http_add_header(&response, "Server", SV("http_server"));
+  for (size_t i = 0; i < nb_entries; i++) {
+    free(entries[i].name);
+  }
+  free(entries);
+  return ok;
+}
 
-  time_t timestamp = time(NULL);
-  struct tm * now = gmtime(&timestamp);
-  char time_buff[40];
-  strftime(time_buff, 39, "%a, %d %b %Y %H:%M:%S %Z", now);
+// The listing of the directory as rendered for its current version,
+// rendered again whenever an entry is added, removed or renamed.
+static struct content_cache_entry* http_directory_listing(const char* path, const char* web_path, const struct stat* dirstat) {
+  char key[PATH_MAX + 9];
+  snprintf(key, sizeof(key), "listing:%s", path);
 
-  http_add_header(&response, "Date", sv_from_cstr(time_buff));
+  struct content_cache_entry* content = content_cache_lookup(key, dirstat);
+  if (content != NULL) {
+    return content;
+  }
 
-  String_View svbuf = sv_from_parts(buff, nb);
-  if (! consume_HTTP_header(&svbuf, &request)) {
-    response.response_code = HTTPSC_RequestHeaderFieldsTooLarge;
-    http_send_error(conn, &response);
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    perror("opendir");
+    return NULL;
+  }
+  // the version read, changes made while rendering will not match it
+  struct stat st;
+  char* listing = NULL;
+  size_t listing_len = 0;
+  if (fstat(dirfd(dir), &st) == 0 && http_render_listing(dir, web_path, &listing, &listing_len)) {
+    content = content_cache_store(key, listing, listing_len, &st);
+  }
+  free(listing);
+  closedir(dir);
+  return content;
+}
 
-    apache2_log_response(conn, &request, &response);
+static struct content_cache_entry* http_gzip_listing(const char* path, struct content_cache_entry* listing) {
+  char key[PATH_MAX + 12];
+  snprintf(key, sizeof(key), "listing.gz:%s", path);
+
+  struct content_cache_entry* content = content_cache_lookup(key, &listing->st);
+  if (content == NULL) {
+    char* compressed = NULL;
+    size_t compressed_len = 0;
+    if (http_gzip(listing->data, listing->size, &compressed, &compressed_len)) {
+      content = content_cache_store(key, compressed, compressed_len, &listing->st);
+      free(compressed);
+    } else {
+      // empty, as for files: not worth trying again
+      content = content_cache_store(key, "", 0, &listing->st);
+    }
+  }
+
+  if (content != NULL && content->size == 0) {
+    content_cache_release(content);
+    return NULL;
+  }
+  return content;
+}
+
+static void http_serve_directory(struct HTTP_Connection* conn, struct HTTP_Request* req, struct HTTP_Response* resp, const char* path, const char* web_path, const struct stat* dirstat) {
+  struct content_cache_entry* listing = http_directory_listing(path, web_path, dirstat);
+  if (listing == NULL) {
+    resp->response_code = HTTPSC_InternalServerError;
+    http_send_error(conn, resp);
     return;
   }
 
-  if (svbuf.data[0] != '\0') { // TODO: fix sketchy length
-    printf("rest: " SV_Fmt "\n", SV_Arg(svbuf));
+  resp->response_code = HTTPSC_OK;
+  http_add_header(resp, "Cache-control", SV("no-cache"));
+  http_add_header(resp, "Content-Type", SV("text/html; charset=utf-8"));
+  http_add_header(resp, "Vary", SV("Accept-Encoding"));
+
+  if (listing->size >= HTTP_GZIP_MIN && listing->size <= http_config.gzip_max && http_accepts_gzip(req)) {
+    struct content_cache_entry* compressed = http_gzip_listing(path, listing);
+    if (compressed != NULL) {
+      content_cache_release(listing);
+      listing = compressed;
+      http_add_header(resp, "Content-Encoding", SV("gzip"));
+    }
   }
+  http_add_content_length(resp, listing->size);
+
+  http_end_headers(resp);
 
-  char path[request.path.count + 1];
-  memcpy(path, request.path.data, request.path.count);
-  path[request.path.count] = '\0';
+  resp->content = listing;
+  resp->body = listing->data;
+  resp->body_len = listing->size;
+}
+
+static void http_handle_request(struct HTTP_Connection* conn) {
+  struct HTTP_Request* request = &conn->request;
+  struct HTTP_Response* response = &conn->response;
+
+  char* path = arena_alloc(&conn->arena, request->path.count + 1);
+  if (path == NULL) {
+    response->response_code = HTTPSC_RequestURITooLarge;
+    http_send_error(conn, response);
+    return;
+  }
+  memcpy(path, request->path.data, request->path.count);
+  path[request->path.count] = '\0';
 
   char* wpath;
-  if (request.path.count > 1) {
+  if (request->path.count > 1) {
     //TODO: anchor parsing
     char* anchor = strchr(path, '#');
     if (anchor != NULL) {
@@ -368,11 +1148,12 @@ void http_handle_connection(struct HTTP_Connection* conn) {
       path_len_no_trailing_slash = path_len_no_trailing_slash - 1;
     }
     if (path_len > path_len_no_trailing_slash) {
-      response.response_code = HTTPSC_MovedPermanently;
-      response.header_only = true;
-      http_add_header(&response, "Location", sv_from_parts(path, path_len_no_trailing_slash));
-      http_send_headers(conn, &response);
-      goto end;
+      response->response_code = HTTPSC_MovedPermanently;
+      response->header_only = true;
+      http_add_header(response, "Location", sv_from_parts(path, path_len_no_trailing_slash));
+      http_add_content_length(response, 0);
+      http_end_headers(response);
+      return;
     }
 
     implodeURIComponent(path);
@@ -384,49 +1165,550 @@ void http_handle_connection(struct HTTP_Connection* conn) {
   }
   // TODO: look for index.html
 
-  char* resolved_path = NULL;
-  resolved_path = realpath(wpath, NULL);
-  if (resolved_path == NULL) {
-    if (errno == ENOENT) {
-      response.response_code = HTTPSC_NotFound;
-      http_send_error(conn, &response);
-    } else if (errno == EACCES) {
-      response.response_code = HTTPSC_Forbidden;
-      http_send_error(conn, &response);
-      perror("realpath");
+  // realpath and stat, usually answered by the path cache
+  struct path_resolution resolution;
+  path_cache_resolve(wpath, &resolution);
+  if (resolution.error != 0) {
+    if (resolution.error == ENOENT || resolution.error == ENOTDIR) {
+      response->response_code = HTTPSC_NotFound;
+      http_send_error(conn, response);
+    } else if (resolution.error == EACCES) {
+      response->response_code = HTTPSC_Forbidden;
+      http_send_error(conn, response);
+      fprintf(stderr, "realpath: %s\n", strerror(resolution.error));
     } else {
-      response.response_code = HTTPSC_InternalServerError;
-      http_send_error(conn, &response);
-      perror("realpath");
+      response->response_code = HTTPSC_InternalServerError;
+      http_send_error(conn, response);
+      fprintf(stderr, "realpath: %s\n", strerror(resolution.error));
     }
-    goto end;
+    return;
   }
 
-  if (strncmp(current_working_directory.data, resolved_path, current_working_directory.count) != 0) {
+  if (! resolution.inside_root) {
     // hide files not in working directory
-    response.response_code = HTTPSC_NotFound;
-    http_send_error(conn, &response);
-    goto end;
+    response->response_code = HTTPSC_NotFound;
+    http_send_error(conn, response);
+    return;
   }
 
+  char* resolved_path = resolution.resolved;
   char* web_path = resolved_path + current_working_directory.count;
 
-  struct stat statbuf;
-  if (stat(resolved_path, &statbuf) == -1) {
-    perror("fstat");
-    goto end;
+  if (S_ISREG(resolution.st.st_mode)) {
+    http_serve_file(conn, request, response, resolved_path, wpath, resolution.st);
+  } else if (S_ISDIR(resolution.st.st_mode)) {
+    http_serve_directory(conn, request, response, resolved_path, web_path, &resolution.st);
+  } else {
+    response->response_code = HTTPSC_NotFound;
+    http_send_error(conn, response);
+  }
+}
+
+static bool http_connection_has_token(String_View connection, String_View token) {
+  while (connection.count > 0) {
+    String_View option = sv_trim(sv_chop_by_delim(&connection, ','));
+    if (sv_eq_ignorecase(option, token)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// HTTP/1.1 connections are persistent unless told otherwise, HTTP/1.0 ones
+// only when the client asks for it. Request bodies are not parsed, so only
+// body-less verbs can keep the connection open.
+static bool http_request_keep_alive(struct HTTP_Request* req) {
+  if (req->verb != GET && req->verb != HEAD) {
+    return false;
   }
+  if (sv_eq(req->version, SV("HTTP/1.1"))) {
+    return ! http_connection_has_token(req->headers->value[HTTP_H_CONNECTION], SV("close"));
+  }
+  return http_connection_has_token(req->headers->value[HTTP_H_CONNECTION], SV("keep-alive"));
+}
+
+static void http_add_connection_header(struct HTTP_Connection* conn) {
+  if (conn->close_after_response) {
+    http_add_header(&conn->response, "Connection", SV("close"));
+    return;
+  }
+  http_add_header(&conn->response, "Connection", SV("keep-alive"));
+
+  char keep_alive[40];
+  if (http_config.max_requests_per_connection > 0) {
+    snprintf(keep_alive, sizeof(keep_alive), "timeout=%u, max=%u", http_config.keep_alive_timeout, http_config.max_requests_per_connection - conn->requests_served);
+  } else {
+    snprintf(keep_alive, sizeof(keep_alive), "timeout=%u", http_config.keep_alive_timeout);
+  }
+  http_add_header(&conn->response, "Keep-Alive", sv_from_cstr(keep_alive));
+}
+
+// Builds the response for the request at the start of the receive buffer,
+// as the parser left it.
+static void http_prepare_response(struct HTTP_Connection* conn, enum http_parse_result parsed) {
+  struct HTTP_Response* response = &conn->response;
+
+  char* date = http_common_headers + sizeof(HTTP_COMMON_HEADERS_PREFIX) - 1;
+  const char* now = timestamp_http_now();
+  if (memcmp(date, now, TIMESTAMP_HTTP_LEN) != 0) {
+    memcpy(date, now, TIMESTAMP_HTTP_LEN);
+  }
+  http_add_raw_headers(response, http_common_headers, sizeof(http_common_headers) - 1);
+
+  conn->requests_served += 1;
 
-  if (S_ISREG(statbuf.st_mode)) {
-    http_serve_file(conn, &request, &response, resolved_path, statbuf);
-  } else if (S_ISDIR(statbuf.st_mode)) {
-    http_serve_directory(conn, &request, &response, resolved_path, web_path);
+  if (parsed != HTTP_PARSE_OK) {
+    conn->close_after_response = true;
+    http_add_connection_header(conn);
+    response->response_code = parsed == HTTP_PARSE_INVALID ? HTTPSC_BadRequest : HTTPSC_RequestHeaderFieldsTooLarge;
+    http_send_error(conn, response);
+    return;
   }
+  consume_HTTP_header(&conn->parsed, &conn->request);
+
+  conn->close_after_response = ! http_request_keep_alive(&conn->request)
+    || (http_config.max_requests_per_connection > 0
+        && conn->requests_served >= http_config.max_requests_per_connection);
+  http_add_connection_header(conn);
+
+  // HEAD gets the same headers as GET, without the body
+  response->header_only = conn->request.verb == HEAD;
+
+  // files are only ever read
+  if (conn->request.verb != GET && conn->request.verb != HEAD) {
+    if (conn->request.verb == UNSUPPORTED) {
+      response->response_code = HTTPSC_NotImplemented;
+    } else {
+      response->response_code = HTTPSC_MethodNotAllowed;
+      http_add_header(response, "Allow", SV("GET, HEAD"));
+    }
+    http_send_error(conn, response);
+    return;
+  }
+
+  http_handle_request(conn);
+
+  if (! response->header_ended) {
+    // every path above should have produced a response
+    response->response_code = HTTPSC_InternalServerError;
+    http_send_error(conn, response);
+  }
+}
+
+// Parses the bytes received since the last call for the request at
+// buff_start. HTTP_PARSE_INCOMPLETE until its header is complete, or too
+// large for the receive buffer.
+static enum http_parse_result http_parse_next(struct HTTP_Connection* conn) {
+  enum http_parse_result result = http_parser_feed(&conn->parser, conn->buff + conn->buff_start,
+                                                   conn->buff_len - conn->buff_start, &conn->parsed);
+  if (result == HTTP_PARSE_INCOMPLETE && conn->buff_start == 0 && conn->buff_len >= http_config.request_max - 1) {
+    return HTTP_PARSE_TOO_MANY_HEADERS;
+  }
+  return result;
+}
+
+static int http_out_append(struct HTTP_Connection* conn, const char* data, size_t len) {
+  if (conn->out_len + len > conn->out_cap) {
+    size_t cap = conn->out_cap > 0 ? conn->out_cap : HTTP_HEADER_BLOCK_LEN;
+    while (cap < conn->out_len + len) {
+      cap *= 2;
+    }
+    char* out = realloc(conn->out, cap);
+    if (out == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    conn->out = out;
+    conn->out_cap = cap;
+  }
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
+  return 0;
+}
+
+// Forgets the response, and everything allocated to answer it
+static void http_response_reset(struct HTTP_Connection* conn) {
+  memset(&conn->response, 0, sizeof(conn->response));
+  conn->response.file_fd = -1;
+  conn->response_pending = false;
+  conn->response.arena = &conn->arena;
+  arena_reset(&conn->arena);
+}
+
+// Forgets the request answered, the parser starts over on the next one
+static void http_request_reset(struct HTTP_Connection* conn) {
+  memset(&conn->request, 0, sizeof(conn->request));
+  http_parser_reset(&conn->parser);
+  memset(&conn->parsed, 0, sizeof(conn->parsed));
+  if (conn->request_buff != NULL) {
+    conn->request.headers = &conn->request_buff->headers;
+    conn->parsed.headers = &conn->request_buff->headers;
+  }
+}
+
+// Request buffers of the connections of the loop running on this thread,
+// a connection never changes loop
+static __thread struct pool http_request_buffers;
+
+static bool http_attach_request_buffer(struct HTTP_Connection* conn) {
+  if (http_request_buffers.object_size == 0) {
+    pool_init(&http_request_buffers, sizeof(struct http_request_buffer));
+  }
+  conn->request_buff = pool_get(&http_request_buffers);
+  if (conn->request_buff == NULL) {
+    return false;
+  }
+  conn->buff = conn->request_buff->data;
+  conn->buff_cap = sizeof(conn->request_buff->data);
+  conn->request.headers = &conn->request_buff->headers;
+  conn->parsed.headers = &conn->request_buff->headers;
+  return true;
+}
+
+static void http_detach_request_buffer(struct HTTP_Connection* conn) {
+  if (conn->request_buff == NULL) {
+    return;
+  }
+  if (conn->buff != conn->request_buff->data) {
+    free(conn->buff);
+  }
+  pool_put(&http_request_buffers, conn->request_buff);
+  conn->request_buff = NULL;
+  conn->buff = NULL;
+  conn->buff_cap = 0;
+  conn->buff_start = 0;
+  conn->buff_len = 0;
+  conn->request.headers = NULL;
+  conn->parsed.headers = NULL;
+}
+
+// Serializes the response headers into the output buffer. Small in memory
+// bodies are copied along, the response is then complete and logged. Returns
+// true when a body remains to be sent once the output buffer is written.
+static bool http_queue_response(struct HTTP_Connection* conn) {
+  struct HTTP_Response* resp = &conn->response;
 
-  if (resolved_path != NULL) {
-    free(resolved_path);
+  if (http_out_append(conn, resp->status_line, resp->status_line_len) == -1
+      || http_out_append(conn, resp->header, resp->header_len) == -1) {
+    conn->close_after_response = true;
+    return false;
   }
 
- end:
-  apache2_log_response(conn, &request, &response);
+  bool has_body = ! resp->header_only && (resp->body_len > 0 || resp->file_fd != -1);
+  if (has_body && (resp->file_fd != -1 || resp->body_len > HTTP_BATCH_BODY_MAX)) {
+    conn->response_pending = true;
+    return true;
+  }
+
+  if (has_body) {
+    if (http_out_append(conn, resp->body, resp->body_len) == -1) {
+      conn->close_after_response = true;
+      return false;
+    }
+    resp->response_len = resp->body_len;
+  }
+
+  apache2_log_response(conn, &conn->request, resp);
+  http_response_release(resp);
+  return false;
+}
+
+// Answers the requests sitting in the receive buffer, in order, starting
+// with the one just parsed. Their responses are coalesced in the output
+// buffer until one of them has a body to send on its own, the connection
+// has to be closed or the batch is big enough.
+static void http_process_requests(struct HTTP_Connection* conn, enum http_parse_result parsed) {
+  do {
+    http_prepare_response(conn, parsed);
+    conn->buff_start += conn->parser.pos;
+
+    if (http_queue_response(conn) || conn->close_after_response || conn->out_len >= HTTP_BATCH_MAX) {
+      break;
+    }
+    http_response_reset(conn);
+    http_request_reset(conn);
+  } while ((parsed = http_parse_next(conn)) != HTTP_PARSE_INCOMPLETE);
+}
+
+bool http_connection_parse(struct HTTP_Connection* conn) {
+  assert(conn->state == HTTP_CONN_READ_REQUEST);
+
+  if (conn->buff_start == conn->buff_len) {
+    return false;
+  }
+  enum http_parse_result parsed = http_parse_next(conn);
+  if (parsed == HTTP_PARSE_INCOMPLETE) {
+    return false;
+  }
+
+  http_process_requests(conn, parsed);
+  conn->state = HTTP_CONN_WRITE_HEADERS;
+  return true;
+}
+
+// The receive buffer is full with a single request, it gets one twice as
+// big, up to the request_max
+static void http_connection_grow_buffer(struct HTTP_Connection* conn) {
+  size_t cap = conn->buff_cap * 2 < http_config.request_max ? conn->buff_cap * 2 : http_config.request_max;
+  char* grown = malloc(cap);
+  if (grown == NULL) {
+    perror("malloc");
+    return;
+  }
+  memcpy(grown, conn->buff, conn->buff_len + 1);
+  http_parser_moved(&conn->parsed, conn->buff, grown);
+  if (conn->buff != conn->request_buff->data) {
+    free(conn->buff);
+  }
+  conn->buff = grown;
+  conn->buff_cap = cap;
+}
+
+size_t http_connection_recv_space(struct HTTP_Connection* conn, char** buff) {
+  if (conn->request_buff == NULL && ! http_attach_request_buffer(conn)) {
+    // no room at all, the connection gets closed
+    *buff = NULL;
+    return 0;
+  }
+
+  if (conn->buff_start > 0) {
+    // make room after the previous requests of the batch, what the parser
+    // already went through of the next one is kept. A bigger buffer is
+    // given up once the rest fits in the request buffer again.
+    char* to = conn->buff;
+    size_t rest = conn->buff_len - conn->buff_start;
+    if (conn->buff != conn->request_buff->data && rest < sizeof(conn->request_buff->data)) {
+      to = conn->request_buff->data;
+    }
+    memmove(to, conn->buff + conn->buff_start, rest);
+    http_parser_moved(&conn->parsed, conn->buff + conn->buff_start, to);
+    if (to != conn->buff) {
+      free(conn->buff);
+      conn->buff = to;
+      conn->buff_cap = sizeof(conn->request_buff->data);
+    }
+    conn->buff_len = rest;
+    conn->buff_start = 0;
+    conn->buff[conn->buff_len] = '\0';
+  }
+
+  if (conn->buff_len + 1 == conn->buff_cap && conn->buff_cap < http_config.request_max) {
+    http_connection_grow_buffer(conn);
+  }
+
+  *buff = conn->buff + conn->buff_len;
+  return conn->buff_cap - 1 - conn->buff_len;
+}
+
+void http_connection_received(struct HTTP_Connection* conn, size_t n) {
+  assert(conn->buff_len + n < conn->buff_cap);
+  conn->buff_len += n;
+  conn->buff[conn->buff_len] = '\0';
+}
+
+int http_connection_output(struct HTTP_Connection* conn, struct iovec iov[2]) {
+  struct HTTP_Response* resp = &conn->response;
+  int iovcnt = 0;
+
+  if (conn->out_written < conn->out_len) {
+    iov[iovcnt].iov_base = conn->out + conn->out_written;
+    iov[iovcnt].iov_len = conn->out_len - conn->out_written;
+    iovcnt++;
+  }
+  if (conn->response_pending && resp->file_fd == -1) {
+    size_t body_written = conn->out_written > conn->out_len ? conn->out_written - conn->out_len : 0;
+    if (body_written < resp->body_len) {
+      iov[iovcnt].iov_base = (char*) resp->body + body_written;
+      iov[iovcnt].iov_len = resp->body_len - body_written;
+      iovcnt++;
+    }
+  }
+  return iovcnt;
+}
+
+void http_connection_output_written(struct HTTP_Connection* conn, size_t n) {
+  struct HTTP_Response* resp = &conn->response;
+  struct iovec iov[2];
+
+  conn->out_written += n;
+  if (http_connection_output(conn, iov) > 0) {
+    return;
+  }
+
+  if (conn->response_pending && resp->file_fd != -1 && resp->file_remaining > 0) {
+    resp->response_len = 0;
+    conn->state = HTTP_CONN_SENDFILE;
+  } else {
+    resp->response_len = conn->response_pending ? resp->body_len : 0;
+    conn->state = HTTP_CONN_DONE;
+  }
+}
+
+void http_connection_file_sent(struct HTTP_Connection* conn, size_t n) {
+  struct HTTP_Response* resp = &conn->response;
+
+  assert(n <= resp->file_remaining);
+  resp->file_remaining -= n;
+  resp->response_len += n;
+  if (resp->file_remaining == 0) {
+    conn->state = HTTP_CONN_DONE;
+  }
+}
+
+enum HTTP_IO_Result http_connection_response_done(struct HTTP_Connection* conn) {
+  if (conn->response_pending) {
+    apache2_log_response(conn, &conn->request, &conn->response);
+  }
+  http_response_release(&conn->response);
+  conn->out_len = 0;
+  conn->out_written = 0;
+
+  if (conn->close_after_response) {
+    return HTTP_IO_CLOSE;
+  }
+
+  http_response_reset(conn);
+  // unless the batch ended on a partial request, the parser keeps what
+  // it made of it
+  if (conn->parser.state == HTTP_PARSER_DONE) {
+    http_request_reset(conn);
+  }
+  conn->state = HTTP_CONN_READ_REQUEST;
+  return HTTP_IO_WANT_READ;
+}
+
+void http_connection_init(struct HTTP_Connection* conn) {
+  conn->state = HTTP_CONN_READ_REQUEST;
+  conn->close_after_response = false;
+  conn->requests_served = 0;
+  conn->buff_start = 0;
+  conn->buff_len = 0;
+  conn->buff_cap = 0;
+  conn->buff = NULL;
+  conn->request_buff = NULL;
+  arena_init(&conn->arena, http_config.arena_max);
+  conn->out = NULL;
+  conn->out_len = 0;
+  conn->out_cap = 0;
+  conn->out_written = 0;
+  http_response_reset(conn);
+  http_request_reset(conn);
+}
+
+void http_connection_release(struct HTTP_Connection* conn) {
+  http_response_release(&conn->response);
+  free(conn->out);
+  conn->out = NULL;
+  conn->out_len = 0;
+  conn->out_cap = 0;
+  http_detach_request_buffer(conn);
+  arena_release(&conn->arena);
+}
+
+static enum HTTP_IO_Result http_read_request(struct HTTP_Connection* conn) {
+  while (! http_connection_parse(conn)) {
+    char* buff;
+    size_t space = http_connection_recv_space(conn, &buff);
+
+    ssize_t nb = recv(conn->client_fd, buff, space, 0);
+    if (nb == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // waiting for the next request takes no buffer
+        if (conn->buff_start == conn->buff_len) {
+          http_detach_request_buffer(conn);
+        }
+        return HTTP_IO_WANT_READ;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return HTTP_IO_CLOSE;
+    }
+    if (nb == 0) {
+      return HTTP_IO_CLOSE;
+    }
+
+    http_connection_received(conn, nb);
+  }
+
+  return HTTP_IO_WANT_WRITE;
+}
+
+static enum HTTP_IO_Result http_write_headers(struct HTTP_Connection* conn) {
+  struct iovec iov[2];
+  int iovcnt;
+
+  while ((iovcnt = http_connection_output(conn, iov)) > 0) {
+    ssize_t ret = writev(conn->client_fd, iov, iovcnt);
+    if (ret == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return HTTP_IO_WANT_WRITE;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("writev");
+      return HTTP_IO_CLOSE;
+    }
+    http_connection_output_written(conn, ret);
+  }
+  if (conn->state == HTTP_CONN_WRITE_HEADERS) {
+    // nothing was queued at all
+    http_connection_output_written(conn, 0);
+  }
+
+  return HTTP_IO_WANT_WRITE;
+}
+
+static enum HTTP_IO_Result http_send_file(struct HTTP_Connection* conn) {
+  struct HTTP_Response* resp = &conn->response;
+
+  while (conn->state == HTTP_CONN_SENDFILE) {
+    ssize_t sent = sendfile(conn->client_fd, resp->file_fd, &resp->file_offset, resp->file_remaining);
+    if (sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return HTTP_IO_WANT_WRITE;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("sendfile");
+      return HTTP_IO_CLOSE;
+    }
+    if (sent == 0) {
+      // file was truncated under us, the announced length can't be honored
+      return HTTP_IO_CLOSE;
+    }
+    http_connection_file_sent(conn, sent);
+  }
+
+  return HTTP_IO_WANT_WRITE;
+}
+
+enum HTTP_IO_Result http_connection_process(struct HTTP_Connection* conn) {
+  enum HTTP_IO_Result ret = HTTP_IO_WANT_READ;
+
+  while (1) {
+    enum HTTP_Connection_State previous_state = conn->state;
+
+    switch (conn->state) {
+    case HTTP_CONN_READ_REQUEST:
+      ret = http_read_request(conn);
+      break;
+    case HTTP_CONN_WRITE_HEADERS:
+      ret = http_write_headers(conn);
+      break;
+    case HTTP_CONN_SENDFILE:
+      ret = http_send_file(conn);
+      break;
+    case HTTP_CONN_DONE:
+      ret = http_connection_response_done(conn);
+      break;
+    }
+
+    // keep going as long as the state machine makes progress
+    if (ret == HTTP_IO_CLOSE || conn->state == previous_state) {
+      return ret;
+    }
+  }
 }
@@ -1,65 +1,206 @@
-
 #ifndef HTTP_HEADER
 #define HTTP_HEADER
 
 #include <sys/socket.h>
-#include <netdb.h>
+#include <sys/types.h>
 #include "sv.h"
+#include "file_cache.h"
+#include "content_cache.h"
 #include "http_status_code.h"
-
-#define HTTP_HEADER_MAX_LEN 1024
+#include "http_parser.h"
+#include "arena.h"
+
+// initial size of the response header block, it grows in the connection arena
+#define HTTP_HEADER_BLOCK_LEN 1024
+// receive buffer a connection gets for a request, requests too large for it
+// get a bigger one, up to http_config.request_max
+#define HTTP_REQUEST_BUFF_LEN 2048
 #define HTTP_HEADER_NAME_MAX_LEN 41
+#define HTTP_STATUS_LINE_MAX_LEN 50
+// pipelined responses with bodies up to this size are copied along with
+// their headers, bigger ones are written on their own
+#define HTTP_BATCH_BODY_MAX 4096
+// stop coalescing pipelined responses past this many bytes
+#define HTTP_BATCH_MAX (64 * 1024)
+// "inode-size-mtime_ns-coding", quoted
+#define HTTP_ETAG_MAX_LEN 72
+// per thread templates of the headers describing a file
+#define HTTP_FILE_HEADERS_CACHE 64 // power of 2
+#define HTTP_FILE_HEADERS_MAX_LEN 384
+// IMF-fixdate is 29 characters
+#define HTTP_DATE_MAX_LEN 40
+// more ranges in a request are ignored, the whole body is sent instead
+#define HTTP_MAX_RANGES 16
+// multipart/byteranges bodies are built in memory, up to this size
+#define HTTP_MULTIPART_MAX (1024 * 1024)
+#define HTTP_MULTIPART_BOUNDARY "3d6b6a416f9b5f1e"
+// gzip-ing smaller bodies is not worth it
+#define HTTP_GZIP_MIN 256
+#define HTTP_GZIP_LEVEL 6
 #define HTTP_HEADER_SEPARATOR ": "
 #define HTTP_ENDL "\r\n"
 
 extern String_View current_working_directory;
 
+struct HTTP_Config {
+  unsigned int max_requests_per_connection; // 0 for no limit
+  unsigned int keep_alive_timeout;          // seconds a connection may wait for a request
+  unsigned int send_timeout;                // seconds a response may go without progress
+  size_t small_file_max;                    // files up to this size are served from memory
+  size_t gzip_max;                          // compressible files up to this size are gzip-ed by the loop, 0 never
+  size_t request_max;                       // request line and header fields, 431 beyond
+  size_t arena_max;                         // memory of a connection for the request being answered
+};
+
+extern struct HTTP_Config http_config;
+
 enum HTTP_Verb {
   GET,
   HEAD,
   POST,
   PUT,
-  DELETE
+  DELETE,
+  UNSUPPORTED // any other method
 };
 
 struct HTTP_Request {
   enum HTTP_Verb verb;
   String_View path;
-  String_View version;  
-  String_View hFrom;
-  String_View hHost;
-  String_View hUseragent;
-  String_View hAccept;
-  String_View hConnection;
-  String_View hIfModifiedSince;
+  String_View version;
+  struct http_header_index* headers;
 };
 
 struct HTTP_Response {
   enum HTTPSTATUSCODES response_code;
 
   bool header_only;
-  bool header_sent;
-  bool status_line_sent;
+  bool header_ended;
+
+  const char* status_line; // shared, see http_init
+  size_t status_line_len;
 
+  struct arena* arena; // of the connection, the header block lives there
   size_t header_len;
-  char header[HTTP_HEADER_MAX_LEN];
+  size_t header_cap;
+  char* header;
+
+  // in memory body, sent along with the headers
+  const char* body;
+  size_t body_len;
+  bool body_allocated;
+  struct content_cache_entry* content; // body is its data
+
+  // file body, sent with sendfile once the headers are out, from a file
+  // shared through the file cache
+  struct file_cache_entry* file;
+  int file_fd;
+  off_t file_offset;
+  size_t file_remaining;
 
   size_t response_len;
 };
 
-struct HTTP_Connection {
-  int client_fd;
-  struct sockaddr* client_addr;
-  socklen_t client_addr_len;
+enum HTTP_Connection_State {
+  HTTP_CONN_READ_REQUEST,
+  HTTP_CONN_WRITE_HEADERS,
+  HTTP_CONN_SENDFILE,
+  HTTP_CONN_DONE
+};
 
-  char hbuf[NI_MAXHOST];
-  char sbuf[NI_MAXSERV];
+enum HTTP_IO_Result {
+  HTTP_IO_WANT_READ,
+  HTTP_IO_WANT_WRITE,
+  HTTP_IO_CLOSE
+};
 
+// What receiving and parsing a request takes, only attached to a connection
+// while it has bytes of one: idle connections do without.
+struct http_request_buffer {
+  struct http_header_index headers;
+  char data[HTTP_REQUEST_BUFF_LEN];
+};
 
-  bool close_on_first_responce;
+// Hot fields first: what every event looks at fits in the first cache
+// lines, the per request state follows, what is only needed for logging
+// comes last.
+struct HTTP_Connection {
+  int client_fd;
+  enum HTTP_Connection_State state;
+  bool close_after_response;
+  bool response_pending; // response body still has to be sent after out
+  unsigned int requests_served;
+
+  size_t buff_start; // start of the request being parsed
+  size_t buff_len;
+  size_t buff_cap;
+  char* buff; // request_buff->data or a bigger one for a large request
+  struct http_request_buffer* request_buff; // NULL while idle
+
+  // serialized responses waiting to be written, consecutive pipelined
+  // responses are coalesced here and sent with a single writev
+  char* out;
+  size_t out_len;
+  size_t out_cap;
+  size_t out_written;
+
+  // owned by the event loop, its list of connections waiting for a
+  // request, or the one of those sending a response, by last activity
+  bool sending;
+  struct HTTP_Connection* idle_prev;
+  struct HTTP_Connection* idle_next;
+  unsigned long long last_activity_ms;
+
+  // the request at buff_start as far as it was received, parsed into
+  // request_buff->headers
+  struct http_parser parser;
+  struct http_parsed_request parsed;
+
+  // what answering a request needs, reset before the next one
+  struct arena arena;
+
+  struct HTTP_Request request;
+  struct HTTP_Response response;
+
+  // cold, the peer is only formatted by the access log, 0 long until
+  // known
+  socklen_t client_addr_len;
+  struct sockaddr_storage client_addr;
 };
 
 
-void http_handle_connection(struct HTTP_Connection*);
+struct iovec;
+
+// Builds the response templates, before any connection is served.
+void http_init(void);
+
+void http_connection_init(struct HTTP_Connection*);
+// Runs the connection state machine until the socket would block.
+// The socket must be non-blocking.
+enum HTTP_IO_Result http_connection_process(struct HTTP_Connection*);
+void http_connection_release(struct HTTP_Connection*);
+
+// Building blocks of http_connection_process, for I/O backends that do
+// not use readiness notifications.
+
+// HTTP_CONN_READ_REQUEST: answers the requests fully received so far and
+// moves to HTTP_CONN_WRITE_HEADERS. Returns false if more bytes are needed.
+bool http_connection_parse(struct HTTP_Connection*);
+// Free space at the end of the receive buffer, to be followed by
+// http_connection_received with the number of bytes stored there.
+size_t http_connection_recv_space(struct HTTP_Connection*, char** buff);
+void http_connection_received(struct HTTP_Connection*, size_t n);
+// HTTP_CONN_WRITE_HEADERS: fills iov with the in memory bytes left to
+// write and returns the number of entries used.
+int http_connection_output(struct HTTP_Connection*, struct iovec iov[2]);
+// Accounts n written bytes, moving to HTTP_CONN_SENDFILE or HTTP_CONN_DONE
+// once everything is out.
+void http_connection_output_written(struct HTTP_Connection*, size_t n);
+// HTTP_CONN_SENDFILE: response.file_fd, from response.file_offset, has
+// response.file_remaining bytes left to send. The caller advances
+// file_offset as it reads the file and reports bytes given to the socket.
+void http_connection_file_sent(struct HTTP_Connection*, size_t n);
+// HTTP_CONN_DONE: logs and releases the response, then either asks for the
+// connection to be closed or goes back to HTTP_CONN_READ_REQUEST.
+enum HTTP_IO_Result http_connection_response_done(struct HTTP_Connection*);
 
 #endif
@@ -0,0 +1,45 @@
+// Build time generator of the perfect hash table of http_headers.h: finds a
+// seed for which the known header names do not collide and prints the
+// table, indexed by hash, of their enum values plus one (0 for none).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_headers.h"
+
+static const char* names[HTTP_HEADER_COUNT] = {
+#define HTTP_HEADER_NAME(id, name) name,
+  HTTP_HEADERS(HTTP_HEADER_NAME)
+#undef HTTP_HEADER_NAME
+};
+
+int main(void) {
+  unsigned char slots[HTTP_HEADER_HASH_SIZE];
+
+  for (unsigned int seed = 0; seed < 1000000; seed++) {
+    memset(slots, 0, sizeof(slots));
+    int i;
+    for (i = 0; i < HTTP_HEADER_COUNT; i++) {
+      unsigned int h = http_header_hash(names[i], strlen(names[i]), seed);
+      if (slots[h] != 0) {
+        break;
+      }
+      slots[h] = i + 1;
+    }
+    if (i < HTTP_HEADER_COUNT) {
+      continue;
+    }
+
+    printf("// Generated by http_header_gen from http_headers.h, do not edit\n");
+    printf("#define HTTP_HEADER_HASH_SEED %uu\n", seed);
+    printf("static const unsigned char http_header_slots[HTTP_HEADER_HASH_SIZE] = {");
+    for (int h = 0; h < HTTP_HEADER_HASH_SIZE; h++) {
+      printf("%s%d,", h % 16 == 0 ? "\n  " : " ", slots[h]);
+    }
+    printf("\n};\n");
+    return EXIT_SUCCESS;
+  }
+
+  fprintf(stderr, "http_header_gen: no perfect hash seed found, grow HTTP_HEADER_HASH_SIZE\n");
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,63 @@
+#ifndef HTTP_HEADERS_HEADER
+#define HTTP_HEADERS_HEADER
+
+#include <stddef.h>
+
+// Header fields the server looks up by name, lower case. Their slots in the
+// perfect hash table are generated at build time by http_header_gen.
+#define HTTP_HEADERS(X)                                 \
+  X(ACCEPT, "accept")                                   \
+  X(ACCEPT_CHARSET, "accept-charset")                   \
+  X(ACCEPT_ENCODING, "accept-encoding")                 \
+  X(ACCEPT_LANGUAGE, "accept-language")                 \
+  X(AUTHORIZATION, "authorization")                     \
+  X(CACHE_CONTROL, "cache-control")                     \
+  X(CONNECTION, "connection")                           \
+  X(CONTENT_LENGTH, "content-length")                   \
+  X(CONTENT_TYPE, "content-type")                       \
+  X(COOKIE, "cookie")                                   \
+  X(DNT, "dnt")                                         \
+  X(EXPECT, "expect")                                   \
+  X(FORWARDED, "forwarded")                             \
+  X(FROM, "from")                                       \
+  X(HOST, "host")                                       \
+  X(IF_MATCH, "if-match")                               \
+  X(IF_MODIFIED_SINCE, "if-modified-since")             \
+  X(IF_NONE_MATCH, "if-none-match")                     \
+  X(IF_RANGE, "if-range")                               \
+  X(IF_UNMODIFIED_SINCE, "if-unmodified-since")         \
+  X(KEEP_ALIVE, "keep-alive")                           \
+  X(ORIGIN, "origin")                                   \
+  X(PRAGMA, "pragma")                                   \
+  X(RANGE, "range")                                     \
+  X(REFERER, "referer")                                 \
+  X(TE, "te")                                           \
+  X(TRANSFER_ENCODING, "transfer-encoding")             \
+  X(UPGRADE, "upgrade")                                 \
+  X(UPGRADE_INSECURE_REQUESTS, "upgrade-insecure-requests") \
+  X(USER_AGENT, "user-agent")                           \
+  X(VIA, "via")                                         \
+  X(X_FORWARDED_FOR, "x-forwarded-for")
+
+enum http_header_name {
+#define HTTP_HEADER_ENUM(id, name) HTTP_H_##id,
+  HTTP_HEADERS(HTTP_HEADER_ENUM)
+#undef HTTP_HEADER_ENUM
+  HTTP_HEADER_COUNT
+};
+
+#define HTTP_HEADER_HASH_BITS 7
+#define HTTP_HEADER_HASH_SIZE (1 << HTTP_HEADER_HASH_BITS)
+
+// Hashes the length and three case folded characters of a field name.
+// Names are tokens, for which | 0x20 only folds letters.
+static inline unsigned int http_header_hash(const char* name, size_t len, unsigned int seed) {
+  unsigned int h = (seed ^ (unsigned int) len) * 0x01000193u;
+  h = (h ^ (unsigned char) (name[0] | 0x20)) * 0x01000193u;
+  h = (h ^ (unsigned char) (name[len / 2] | 0x20)) * 0x01000193u;
+  h = (h ^ (unsigned char) (name[len - 1] | 0x20)) * 0x01000193u;
+  // the high bits depend on all of the seed
+  return (h * 0x9e3779b1u) >> (32 - HTTP_HEADER_HASH_BITS);
+}
+
+#endif
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE 1
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86 1
+#endif
+
+#include "http_parser.h"
+#include "http_header_hash.h"
+
+static const String_View header_names[HTTP_HEADER_COUNT] = {
+#define HTTP_HEADER_NAME(id, name) SV_STATIC(name),
+  HTTP_HEADERS(HTTP_HEADER_NAME)
+#undef HTTP_HEADER_NAME
+};
+
+// Token characters (RFC 9110 tchar): what methods and field names are made of
+static const bool tchar[256] = {
+  ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+  ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+  ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+  ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+  ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+  ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+  ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+  ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+  ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+// Up to 4 delimiters, repeated to fill the set when there are fewer
+struct http_scan_set {
+  char c[4];
+  int n;
+};
+
+static const struct http_scan_set request_line_delims = { { ' ', '\r', '\n', ' ' }, 3 };
+static const struct http_scan_set name_delims = { { ':', '\r', '\n', ':' }, 3 };
+static const struct http_scan_set line_delims = { { '\r', '\n', '\r', '\n' }, 2 };
+
+// First byte of [p, end) in the set, end if none
+typedef const char* (*http_scan_fn)(const char* p, const char* end, const struct http_scan_set* set);
+// Whether the n bytes at p are all tchar. Bytes up to end may be read.
+typedef bool (*http_token_fn)(const char* p, size_t n, const char* end);
+
+static const char* scan_scalar(const char* p, const char* end, const struct http_scan_set* set) {
+  for (; p < end; p++) {
+    char c = *p;
+    if (c == set->c[0] || c == set->c[1] || c == set->c[2] || c == set->c[3]) {
+      return p;
+    }
+  }
+  return end;
+}
+
+static bool token_scalar(const char* p, size_t n, const char* end) {
+  for (size_t i = 0; i < n; i++) {
+    if (! tchar[(unsigned char) p[i]]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef HTTP_PARSER_X86
+
+// pcmpestri compares 16 bytes against the whole set in one instruction
+__attribute__((target("sse4.2")))
+static const char* scan_sse42(const char* p, const char* end, const struct http_scan_set* set) {
+  int packed;
+  memcpy(&packed, set->c, sizeof(packed));
+  const __m128i needles = _mm_cvtsi32_si128(packed);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) p);
+    int index = _mm_cmpestri(needles, set->n, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+    if (index < 16) {
+      return p + index;
+    }
+    p += 16;
+  }
+  return scan_scalar(p, end, set);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_avx2(const char* p, const char* end, const struct http_scan_set* set) {
+  const __m256i c0 = _mm256_set1_epi8(set->c[0]);
+  const __m256i c1 = _mm256_set1_epi8(set->c[1]);
+  const __m256i c2 = _mm256_set1_epi8(set->c[2]);
+  const __m256i c3 = _mm256_set1_epi8(set->c[3]);
+  while (end - p >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) p);
+    __m256i found = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, c0), _mm256_cmpeq_epi8(chunk, c1)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, c2), _mm256_cmpeq_epi8(chunk, c3)));
+    unsigned int mask = _mm256_movemask_epi8(found);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  // not scan_sse42: mixing legacy SSE encoded instructions with AVX ones
+  // costs a state transition
+  if (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) p);
+    __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(c0)), _mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(c1))),
+                                 _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(c2)), _mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(c3))));
+    unsigned int mask = _mm_movemask_epi8(found);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+  return scan_scalar(p, end, set);
+}
+
+// tchar classes by nibble: a byte is a tchar when the bits found for its
+// low and high nibbles intersect. One bit per high nibble 2 to 7, bytes
+// outside 0x20-0x7f find no bit.
+static const uint8_t token_low_nibble[16] = {
+  0x3a, 0x3f, 0x3e, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3e, 0x3e, 0x3d, 0x15, 0x34, 0x15, 0x3d, 0x1c
+};
+static const uint8_t token_high_nibble[16] = {
+  0, 0, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+__attribute__((target("avx2")))
+static bool token_avx2(const char* p, size_t n, const char* end) {
+  const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) token_low_nibble));
+  const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) token_high_nibble));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  // whole vectors, the last one may be partly past the token
+  while (n > 0 && end - p >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) p);
+    __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(chunk, nibble));
+    __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble));
+    __m256i invalid = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+    unsigned int mask = _mm256_movemask_epi8(invalid);
+    if (n < 32) {
+      return (mask & ((1u << n) - 1)) == 0;
+    }
+    if (mask != 0) {
+      return false;
+    }
+    p += 32;
+    n -= 32;
+  }
+  return token_scalar(p, n, end);
+}
+
+#endif
+
+static http_scan_fn scan = scan_scalar;
+static http_token_fn token = token_scalar;
+static const char* implementation = "scalar";
+
+void http_parser_init(void) {
+#ifdef HTTP_PARSER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan = scan_avx2;
+    token = token_avx2;
+    implementation = "avx2";
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    scan = scan_sse42;
+    implementation = "sse4.2";
+  }
+#endif
+}
+
+const char* http_parser_implementation(void) {
+  return implementation;
+}
+
+enum http_header_name http_header_lookup(String_View name) {
+  unsigned int slot = http_header_slots[http_header_hash(name.data, name.count, HTTP_HEADER_HASH_SEED)];
+  if (slot == 0) {
+    return HTTP_HEADER_COUNT;
+  }
+  // the one candidate, compared case folded: names are tokens
+  String_View known = header_names[slot - 1];
+  if (known.count != name.count) {
+    return HTTP_HEADER_COUNT;
+  }
+  for (size_t i = 0; i < name.count; i++) {
+    if ((name.data[i] | 0x20) != known.data[i]) {
+      return HTTP_HEADER_COUNT;
+    }
+  }
+  return slot - 1;
+}
+
+static String_View http_trim_ows(const char* start, const char* end) {
+  while (start < end && (*start == ' ' || *start == '\t')) {
+    start++;
+  }
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+    end--;
+  }
+  return sv_from_parts(start, end - start);
+}
+
+void http_parser_reset(struct http_parser* parser) {
+  parser->state = HTTP_PARSER_METHOD;
+  parser->pos = 0;
+  parser->start = 0;
+  parser->name_start = 0;
+  parser->name_len = 0;
+}
+
+static void http_view_move(String_View* view, const char* from, const char* to) {
+  if (view->data != NULL) {
+    view->data = to + (view->data - from);
+  }
+}
+
+void http_parser_moved(struct http_parsed_request* req, const char* from, const char* to) {
+  http_view_move(&req->method, from, to);
+  http_view_move(&req->target, from, to);
+  http_view_move(&req->version, from, to);
+  struct http_header_index* headers = req->headers;
+  for (size_t i = 0; i < HTTP_HEADER_COUNT; i++) {
+    http_view_move(&headers->value[i], from, to);
+  }
+  for (size_t i = 0; i < headers->nb_other; i++) {
+    http_view_move(&headers->other[i].name, from, to);
+    http_view_move(&headers->other[i].value, from, to);
+  }
+}
+
+static enum http_parse_result http_add_field(struct http_header_index* headers, String_View name, String_View value) {
+  enum http_header_name known = http_header_lookup(name);
+  if (known != HTTP_HEADER_COUNT && headers->value[known].data == NULL) {
+    headers->value[known] = value;
+  } else if (headers->nb_other < HTTP_PARSER_MAX_OTHER_HEADERS) {
+    headers->other[headers->nb_other].name = name;
+    headers->other[headers->nb_other].value = value;
+    headers->nb_other++;
+  } else {
+    return HTTP_PARSE_TOO_MANY_HEADERS;
+  }
+  return HTTP_PARSE_OK;
+}
+
+enum http_parse_result http_parser_feed(struct http_parser* parser, const char* data, size_t len, struct http_parsed_request* req) {
+  const char* p = data + parser->pos;
+  const char* start = data + parser->start; // of the element being scanned
+  const char* end = data + len;
+
+  if (parser->pos == 0) {
+    memset(req->headers->value, 0, sizeof(req->headers->value));
+    req->headers->nb_other = 0;
+  }
+
+  // each state scans from where the previous call stopped, only the
+  // elements it delimits are looked at again, to validate or trim them
+  while (p < end) {
+    switch (parser->state) {
+    // method SP target [SP version] CRLF
+    case HTTP_PARSER_METHOD:
+      p = scan(p, end, &request_line_delims);
+      if (p == end) {
+        break;
+      }
+      if (p == start || *p != ' ' || ! token(start, p - start, end)) {
+        return HTTP_PARSE_INVALID;
+      }
+      req->method = sv_from_parts(start, p - start);
+      start = ++p;
+      parser->state = HTTP_PARSER_TARGET;
+      break;
+
+    case HTTP_PARSER_TARGET:
+      p = scan(p, end, &request_line_delims);
+      if (p == end) {
+        break;
+      }
+      if (p == start) {
+        return HTTP_PARSE_INVALID;
+      }
+      req->target = sv_from_parts(start, p - start);
+      if (*p == ' ') {
+        start = ++p;
+        parser->state = HTTP_PARSER_VERSION;
+      } else {
+        req->version = SV_NULL;
+        parser->state = HTTP_PARSER_CR;
+      }
+      break;
+
+    case HTTP_PARSER_VERSION:
+      p = scan(p, end, &request_line_delims);
+      if (p == end) {
+        break;
+      }
+      if (*p == ' ') {
+        return HTTP_PARSE_INVALID;
+      }
+      req->version = sv_from_parts(start, p - start);
+      parser->state = HTTP_PARSER_CR;
+      break;
+
+    // lines must end with CRLF, a lone CR or LF is an error
+    case HTTP_PARSER_CR:
+      if (*p++ != '\r') {
+        return HTTP_PARSE_INVALID;
+      }
+      parser->state = HTTP_PARSER_LF;
+      break;
+
+    case HTTP_PARSER_LF:
+      if (*p++ != '\n') {
+        return HTTP_PARSE_INVALID;
+      }
+      parser->state = HTTP_PARSER_FIELD;
+      break;
+
+    // name ":" OWS value OWS CRLF, until the empty line
+    case HTTP_PARSER_FIELD:
+      start = p;
+      if (*p == '\r') {
+        p++;
+        parser->state = HTTP_PARSER_END;
+      } else {
+        parser->state = HTTP_PARSER_NAME;
+      }
+      break;
+
+    case HTTP_PARSER_NAME:
+      p = scan(p, end, &name_delims);
+      if (p == end) {
+        break;
+      }
+      if (p == start || *p != ':' || ! token(start, p - start, end)) {
+        return HTTP_PARSE_INVALID;
+      }
+      parser->name_start = start - data;
+      parser->name_len = p - start;
+      start = ++p;
+      parser->state = HTTP_PARSER_VALUE;
+      break;
+
+    case HTTP_PARSER_VALUE: {
+      p = scan(p, end, &line_delims);
+      if (p == end) {
+        break;
+      }
+      String_View name = sv_from_parts(data + parser->name_start, parser->name_len);
+      enum http_parse_result result = http_add_field(req->headers, name, http_trim_ows(start, p));
+      if (result != HTTP_PARSE_OK) {
+        return result;
+      }
+      parser->state = HTTP_PARSER_CR;
+      break;
+    }
+
+    case HTTP_PARSER_END:
+      if (*p++ != '\n') {
+        return HTTP_PARSE_INVALID;
+      }
+      parser->state = HTTP_PARSER_DONE;
+      parser->pos = p - data;
+      return HTTP_PARSE_OK;
+
+    case HTTP_PARSER_DONE:
+      return HTTP_PARSE_OK;
+    }
+  }
+
+  if (parser->state == HTTP_PARSER_DONE) {
+    return HTTP_PARSE_OK;
+  }
+  parser->pos = p - data;
+  parser->start = start - data;
+  return HTTP_PARSE_INCOMPLETE;
+}
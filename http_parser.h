@@ -0,0 +1,82 @@
+#ifndef HTTP_PARSER_HEADER
+#define HTTP_PARSER_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "sv.h"
+#include "http_headers.h"
+
+#define HTTP_PARSER_MAX_OTHER_HEADERS 32
+
+struct http_header_field {
+  String_View name;
+  String_View value; // without surrounding whitespace
+};
+
+// Header fields of a request: the known ones by name, the first time they
+// appear, anything else in order. Views into the parsed bytes.
+struct http_header_index {
+  String_View value[HTTP_HEADER_COUNT]; // empty when absent
+  size_t nb_other;
+  struct http_header_field other[HTTP_PARSER_MAX_OTHER_HEADERS];
+};
+
+struct http_parsed_request {
+  String_View method;
+  String_View target;
+  String_View version; // empty for a request line without one
+  struct http_header_index* headers;
+};
+
+enum http_parse_result {
+  HTTP_PARSE_OK,
+  HTTP_PARSE_INCOMPLETE, // more bytes are needed
+  HTTP_PARSE_INVALID,
+  HTTP_PARSE_TOO_MANY_HEADERS
+};
+
+// Picks the widest scanner the cpu supports: AVX2, SSE4.2 or plain C.
+// Call once before parsing, the scalar one is used until then.
+void http_parser_init(void);
+const char* http_parser_implementation(void);
+
+// The known header a field name is, HTTP_HEADER_COUNT if none.
+enum http_header_name http_header_lookup(String_View name);
+
+enum http_parser_state {
+  HTTP_PARSER_METHOD,
+  HTTP_PARSER_TARGET,
+  HTTP_PARSER_VERSION,
+  HTTP_PARSER_CR,
+  HTTP_PARSER_LF,
+  HTTP_PARSER_FIELD,
+  HTTP_PARSER_NAME,
+  HTTP_PARSER_VALUE,
+  HTTP_PARSER_END,
+  HTTP_PARSER_DONE
+};
+
+// Where the parsing of a request stopped, as offsets from its first byte
+struct http_parser {
+  enum http_parser_state state;
+  size_t pos;        // bytes consumed, the request length once done
+  size_t start;      // of the element being scanned
+  size_t name_start; // of the field whose value is being scanned
+  size_t name_len;
+};
+
+// Before the first byte of each request.
+void http_parser_reset(struct http_parser* parser);
+
+// Parses the request line and header fields of the request at data, len
+// bytes of it received so far, resuming where the previous call stopped:
+// bytes already consumed are not scanned again. Returns
+// HTTP_PARSE_INCOMPLETE until the empty line closing the header block.
+// The fields go to req->headers, its views point into data.
+enum http_parse_result http_parser_feed(struct http_parser* parser, const char* data, size_t len, struct http_parsed_request* req);
+
+// The request bytes were moved from "from" to "to" between two calls to
+// http_parser_feed, req is made to point to their new place.
+void http_parser_moved(struct http_parsed_request* req, const char* from, const char* to);
+
+#endif
@@ -3,11 +3,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
 #include <netinet/ip.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 
 #include "threadpool.h"
+#include "event_loop.h"
 #include "http.h"
+#include "file_cache.h"
+#include "content_cache.h"
+#include "path_cache.h"
+#include "fs_watch.h"
+#include "access_log.h"
+#include "http_parser.h"
 #define SV_IMPLEMENTATION
 #include "sv.h"
 
@@ -18,15 +29,20 @@
 
 String_View current_working_directory = {0};
 
-static int init_socket(int port) {
-  int s = socket(AF_INET, SOCK_STREAM, 0);
+// With reuseport, several sockets can listen on the same port and the
+// kernel balances incoming connections between them.
+static int init_socket(int port, bool reuseport) {
+  int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (s == -1)
     handle_error("socket");
 
   const int enable = 1;
   if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1)
     handle_error("setsockopt(SO_REUSEADDR) failed");
-  
+
+  if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) == -1)
+    handle_error("setsockopt(SO_REUSEPORT) failed");
+
   struct sockaddr_in my_addr = {
     .sin_family = AF_INET,
     .sin_port   = htons(port),
@@ -44,47 +60,237 @@ static int init_socket(int port) {
   return s;
 }
 
-static void child_main(struct HTTP_Connection* conn) {
-  http_handle_connection(conn);
-  close(conn->client_fd);
+// Cached files compete with connections for file descriptors: raise the
+// limit as far as allowed and give the cache a quarter of it.
+static size_t file_cache_size(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    return 0;
 
-  free(conn);
+  if (limit.rlim_cur < limit.rlim_max) {
+    rlim_t cur = limit.rlim_cur;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+      limit.rlim_cur = cur;
+  }
+
+  rlim_t size = limit.rlim_cur / 4;
+  return size < FILE_CACHE_MAX_FDS ? size : FILE_CACHE_MAX_FDS;
 }
 
-int main(void) {
+static int nb_event_loops(void) {
+  long nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_cpu < 1)
+    return 1;
+  if (nb_cpu > MAX_THREADS)
+    return MAX_THREADS;
+  return nb_cpu;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "Usage: %s [-k max_requests_per_connection] [-t keep_alive_timeout] [-w send_timeout] [-s small_file_kb] [-m cache_mb] [-z gzip_max_kb] [-l request_kb] [-e arena_kb] [-b] [-r] [-a] [-c] [-u]\n", name);
+  fprintf(stderr, "  -k  requests served on a persistent connection before closing it, 0 for no limit (default %u)\n", http_config.max_requests_per_connection);
+  fprintf(stderr, "  -t  seconds an idle connection is kept open waiting for a request (default %u).\n"
+          "      It does not apply while a response is sent, see -w\n", http_config.keep_alive_timeout);
+  fprintf(stderr, "  -w  seconds a response may go without the client reading any of it before the connection is closed (default %u)\n", http_config.send_timeout);
+  fprintf(stderr, "  -s  files up to this many KiB are served from memory, 0 to always send them from disk (default %zu)\n", http_config.small_file_max / 1024);
+  fprintf(stderr, "  -m  MiB of memory for the content of small files (default %u)\n", CONTENT_CACHE_DEFAULT_MB);
+  fprintf(stderr, "  -z  text files up to this many KiB are gzip-ed for clients accepting it, once per version, 0 never (default %zu).\n"
+          "      It stalls the event loop meanwhile, bigger files are better precompressed next to them (.gz)\n", http_config.gzip_max / 1024);
+  fprintf(stderr, "  -l  KiB a request line and its header fields may take, larger requests get a 431 (default %zu)\n", http_config.request_max / 1024);
+  fprintf(stderr, "  -e  KiB a connection may allocate to answer a request (default %zu)\n", http_config.arena_max / 1024);
+  fprintf(stderr, "  -b  wait for the access log to catch up instead of dropping records\n");
+  fprintf(stderr, "  -r  one SO_REUSEPORT listening socket per event loop instead of a shared one\n");
+  fprintf(stderr, "  -a  pin each event loop thread to its own cpu\n");
+  fprintf(stderr, "  -c  steer connections to the loop of the cpu receiving them (SO_INCOMING_CPU), implies -r and -a\n");
+  fprintf(stderr, "  -u  io_uring I/O instead of epoll, when the kernel supports it\n");
+}
+
+static bool parse_uint(const char* str, unsigned int* value) {
+  char* end;
+  errno = 0;
+  unsigned long v = strtoul(str, &end, 10);
+  if (errno != 0 || *str == '\0' || *end != '\0' || v > UINT_MAX) {
+    return false;
+  }
+  *value = v;
+  return true;
+}
+
+int main(int argc, char** argv) {
+  bool reuseport = false;
+  bool incoming_cpu = false;
+  bool pin = false;
+  enum access_log_policy log_policy = ACCESS_LOG_DROP;
+  unsigned int small_file_kb;
+  unsigned int gzip_max_kb;
+  unsigned int request_kb;
+  unsigned int arena_kb;
+  unsigned int content_cache_mb = CONTENT_CACHE_DEFAULT_MB;
+  enum event_loop_backend backend = EVENT_LOOP_EPOLL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "k:t:w:s:m:z:l:e:bracuh")) != -1) {
+    switch (opt) {
+    case 'u':
+      backend = EVENT_LOOP_IO_URING;
+      break;
+    case 'b':
+      log_policy = ACCESS_LOG_BLOCK;
+      break;
+    case 'r':
+      reuseport = true;
+      break;
+    case 'a':
+      pin = true;
+      break;
+    case 'c':
+      reuseport = true;
+      pin = true;
+      incoming_cpu = true;
+      break;
+    case 's':
+      if (! parse_uint(optarg, &small_file_kb)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      http_config.small_file_max = (size_t) small_file_kb * 1024;
+      break;
+    case 'z':
+      if (! parse_uint(optarg, &gzip_max_kb)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      http_config.gzip_max = (size_t) gzip_max_kb * 1024;
+      break;
+    case 'l':
+      if (! parse_uint(optarg, &request_kb) || request_kb == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      http_config.request_max = (size_t) request_kb * 1024;
+      break;
+    case 'e':
+      if (! parse_uint(optarg, &arena_kb) || arena_kb == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      http_config.arena_max = (size_t) arena_kb * 1024;
+      break;
+    case 'm':
+      if (! parse_uint(optarg, &content_cache_mb)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'k':
+      if (! parse_uint(optarg, &http_config.max_requests_per_connection)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 't':
+      if (! parse_uint(optarg, &http_config.keep_alive_timeout) || http_config.keep_alive_timeout == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'w':
+      if (! parse_uint(optarg, &http_config.send_timeout) || http_config.send_timeout == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
   int port = 8080;
-  int s = init_socket(port);
+  int s = -1;
+  if (! reuseport) {
+    s = init_socket(port, false);
+  }
+
+  // a client going away mid response must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // only the main thread handles these, every thread started from now on
+  // inherits the mask
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+  http_init();
+  size_t cached_files = file_cache_size();
+  file_cache_init(cached_files);
+  content_cache_init((size_t) content_cache_mb * 1024 * 1024);
 
   char* temp_cwd = get_current_dir_name();
   current_working_directory = sv_from_cstr(temp_cwd);
 
+  path_cache_init(temp_cwd, PATH_CACHE_MAX_ENTRIES);
+  if (! fs_watch_start()) {
+    fprintf(stderr, "no inotify, cached paths are trusted for %d ms\n", PATH_CACHE_TTL_MS);
+  }
+
   printf("Serving files in \"%s\"\n", temp_cwd);
   printf("Listening on port http://0.0.0.0:%d/\n", port);
+  printf("Parsing requests with the %s scanner\n", http_parser_implementation());
+  printf("Keeping up to %zu files open, and the content of files up to %zu KiB in %u MiB\n", cached_files, http_config.small_file_max / 1024, content_cache_mb);
 
-  threadpool_t* tp = threadpool_create(5, NB_CLIENT_MAX, 0);
-  
-  while (1) {
-    struct HTTP_Connection* conn = calloc(1, sizeof(struct HTTP_Connection));
-    struct sockaddr_in client_addr = {0};
-    conn->client_addr_len = sizeof(client_addr);
-
-    conn->client_fd = accept(s, (struct sockaddr*) &client_addr, &(conn->client_addr_len));
-    if (conn->client_fd == -1)
-      handle_error("accept");
-    
-    conn->client_addr = (struct sockaddr*)&client_addr;
-    conn->close_on_first_responce = true;
-
-    int getnameinfo_ret = getnameinfo(conn->client_addr, conn->client_addr_len, conn->hbuf, sizeof(conn->hbuf), conn->sbuf, sizeof(conn->sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
-    if (getnameinfo_ret != 0)
-      printf("could not getnameinfo: %s\n", gai_strerror(getnameinfo_ret));
-
-    if (threadpool_add(tp, (void (*)(void *))child_main, conn, 0) < 0){
+  int nb_loops = nb_event_loops();
+  if (reuseport) {
+    printf("%d event loops, one listening socket each%s\n", nb_loops, incoming_cpu ? " steered by incoming cpu" : "");
+  } else {
+    printf("%d event loops sharing one listening socket\n", nb_loops);
+  }
+
+  threadpool_t* tp = threadpool_create(nb_loops, nb_loops, pin ? threadpool_pin_workers : 0);
+  if (tp == NULL) {
+    fprintf(stderr, "threadpool_create error\n");
+    return EXIT_FAILURE;
+  }
+  if (pin) {
+    for (int i = 0; i < nb_loops; i++) {
+      printf("worker %d: cpu %d, numa node %d\n", i, threadpool_worker_cpu(tp, i), threadpool_worker_node(tp, i));
+    }
+  }
+
+  // the logger writes to stdout directly, past stdio
+  fflush(stdout);
+  if (! access_log_start(STDOUT_FILENO, log_policy)) {
+    return EXIT_FAILURE;
+  }
+
+  // one event loop per core, each one runs for the lifetime of the server
+  // on its own worker thread
+  for (int i = 0; i < nb_loops; i++) {
+    int listen_fd = s;
+    if (reuseport) {
+      listen_fd = init_socket(port, true);
+    }
+
+    struct event_loop* loop = event_loop_create(i, listen_fd, backend);
+    if (loop == NULL)
+      handle_error("event_loop_create");
+    loop->incoming_cpu = incoming_cpu;
+
+    if (threadpool_add(tp, event_loop_run, loop, 0) < 0) {
       fprintf(stderr, "threadpool_add error");
       return EXIT_FAILURE;
     }
   }
-  
+
+  // the loops never return: run until asked to stop, then write out the
+  // access log before the process exits
+  int sig;
+  sigwait(&stop_signals, &sig);
+  access_log_stop();
+
   printf("End\n");
   free(temp_cwd);
   return EXIT_SUCCESS;
@@ -0,0 +1,556 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "path_cache.h"
+#include "fs_watch.h"
+
+#define PATH_CACHE_BUCKETS 1024 // per shard, power of 2
+#define PATH_CACHE_DEPS 8
+#define PATH_CACHE_INDEX_BUCKETS 4096 // power of 2
+#define PATH_CACHE_WATCH_BUCKETS 256 // power of 2
+// a name appearing, disappearing or changing permissions in a directory
+#define PATH_CACHE_NAME_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+// the watched file or directory itself going away
+#define PATH_CACHE_SELF_MASK (IN_DELETE_SELF | IN_MOVE_SELF)
+#define PATH_CACHE_DIR_MASK (PATH_CACHE_NAME_MASK | PATH_CACHE_SELF_MASK)
+// the resolved file being written to, its stat changes
+#define PATH_CACHE_FILE_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | PATH_CACHE_SELF_MASK)
+
+struct path_cache_watch;
+
+// Something an entry was resolved from: a name in a watched directory, or
+// the watched file or directory itself when name is NULL. Linked in the
+// index by wd and name, so an event only looks at the entries it is about.
+struct path_cache_dep {
+  struct path_cache_entry* entry;
+  struct path_cache_watch* watch; // NULL while not in the index
+  int wd;
+  uint32_t mask; // events invalidating the entry
+  const char* name; // in the entry's path or resolved path
+  size_t name_len;
+  unsigned int hash;
+  struct path_cache_dep* next; // index chain
+  struct path_cache_dep** link;
+  struct path_cache_dep* watch_next; // among the deps on the same wd
+  struct path_cache_dep** watch_link;
+};
+
+// What is known of a wd: the entries depending on it and when it last
+// changed, a resolution that started before is not cached.
+struct path_cache_watch {
+  int wd;
+  bool gone; // dropped by the kernel, freed once no dep is left
+  unsigned int last_event;
+  struct path_cache_dep* deps;
+  struct path_cache_watch* next;
+};
+
+struct path_cache_entry {
+  char* path;
+  unsigned int hash;
+  unsigned long long expires_ms;
+  bool unwatched;   // something it depends on could not be watched
+  bool cached;      // in its shard
+  bool invalidated; // an event came before it made it to its shard
+  int nb_deps;
+  struct path_cache_dep deps[PATH_CACHE_DEPS];
+  struct path_cache_entry* next; // hash chain
+  struct path_cache_entry* lru_prev;
+  struct path_cache_entry* lru_next;
+
+  int error;
+  bool inside_root;
+  struct stat st;
+  size_t resolved_len;
+  char resolved[];
+};
+
+struct path_cache_shard {
+  pthread_mutex_t lock;
+  struct path_cache_entry* buckets[PATH_CACHE_BUCKETS];
+  struct path_cache_entry* lru_head; // most recently used
+  struct path_cache_entry* lru_tail;
+  size_t count;
+};
+
+static struct path_cache_shard shards[PATH_CACHE_SHARDS];
+static size_t max_per_shard;
+static const char* root;
+static size_t root_len;
+
+// The index and the watches are only used on misses and events. Taken
+// before a shard lock, never after.
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct path_cache_dep* index_buckets[PATH_CACHE_INDEX_BUCKETS];
+static struct path_cache_watch* watch_buckets[PATH_CACHE_WATCH_BUCKETS];
+// bumped on every inotify event, it dates them
+static atomic_uint events;
+static unsigned int last_overflow;
+
+static unsigned long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int path_cache_hash(const char* path) {
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (; *path != '\0'; path++) {
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
+  }
+  return hash;
+}
+
+static unsigned int path_cache_dep_hash(int wd, const char* name, size_t name_len) {
+  unsigned int hash = (2166136261u ^ (unsigned int) wd) * 16777619u;
+  for (size_t i = 0; i < name_len; i++) {
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// seq happened after since, counters wrap
+static bool path_cache_after(unsigned int seq, unsigned int since) {
+  return (int) (seq - since) > 0;
+}
+
+static void path_cache_lru_unlink(struct path_cache_shard* shard, struct path_cache_entry* entry) {
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    shard->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    shard->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void path_cache_lru_push(struct path_cache_shard* shard, struct path_cache_entry* entry) {
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head != NULL) {
+    shard->lru_head->lru_prev = entry;
+  } else {
+    shard->lru_tail = entry;
+  }
+  shard->lru_head = entry;
+}
+
+// Whoever takes an entry out of its shard frees it
+static void path_cache_detach(struct path_cache_shard* shard, struct path_cache_entry* entry) {
+  struct path_cache_entry** link = &shard->buckets[entry->hash & (PATH_CACHE_BUCKETS - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  path_cache_lru_unlink(shard, entry);
+  entry->cached = false;
+  shard->count--;
+}
+
+static struct path_cache_watch** path_cache_find_watch(int wd) {
+  struct path_cache_watch** link = &watch_buckets[(unsigned int) wd & (PATH_CACHE_WATCH_BUCKETS - 1)];
+  while (*link != NULL && (*link)->wd != wd) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Under the index lock
+static struct path_cache_watch* path_cache_get_watch(int wd, unsigned int seq) {
+  struct path_cache_watch** link = path_cache_find_watch(wd);
+  if (*link == NULL) {
+    struct path_cache_watch* watch = malloc(sizeof(struct path_cache_watch));
+    if (watch == NULL) {
+      return NULL;
+    }
+    watch->wd = wd;
+    watch->gone = false;
+    watch->last_event = seq;
+    watch->deps = NULL;
+    watch->next = NULL;
+    *link = watch;
+  }
+  return *link;
+}
+
+static void path_cache_forget_watch(int wd) {
+  struct path_cache_watch** link = path_cache_find_watch(wd);
+  struct path_cache_watch* watch = *link;
+  if (watch != NULL && watch->gone && watch->deps == NULL) {
+    *link = watch->next;
+    free(watch);
+  }
+}
+
+// Under the index lock
+static void path_cache_link_dep(struct path_cache_dep* dep, struct path_cache_watch* watch) {
+  struct path_cache_dep** bucket = &index_buckets[dep->hash & (PATH_CACHE_INDEX_BUCKETS - 1)];
+  dep->watch = watch;
+  dep->next = *bucket;
+  dep->link = bucket;
+  if (*bucket != NULL) {
+    (*bucket)->link = &dep->next;
+  }
+  *bucket = dep;
+  dep->watch_next = watch->deps;
+  dep->watch_link = &watch->deps;
+  if (watch->deps != NULL) {
+    watch->deps->watch_link = &dep->watch_next;
+  }
+  watch->deps = dep;
+}
+
+// Under the index lock
+static void path_cache_unlink_deps(struct path_cache_entry* entry) {
+  for (int i = 0; i < entry->nb_deps; i++) {
+    struct path_cache_dep* dep = &entry->deps[i];
+    if (dep->watch == NULL) {
+      continue;
+    }
+    *dep->link = dep->next;
+    if (dep->next != NULL) {
+      dep->next->link = dep->link;
+    }
+    *dep->watch_link = dep->watch_next;
+    if (dep->watch_next != NULL) {
+      dep->watch_next->watch_link = dep->watch_link;
+    }
+    dep->watch = NULL;
+    path_cache_forget_watch(dep->wd);
+  }
+}
+
+// Out of the locks, removing watches is a syscall
+static void path_cache_free(struct path_cache_entry* entry) {
+  for (int i = 0; i < entry->nb_deps; i++) {
+    fs_watch_remove(entry->deps[i].wd);
+  }
+  free(entry->path);
+  free(entry);
+}
+
+static void path_cache_free_list(struct path_cache_entry* entry) {
+  while (entry != NULL) {
+    struct path_cache_entry* next = entry->next;
+    path_cache_free(entry);
+    entry = next;
+  }
+}
+
+// For an entry taken out of its shard or never put in
+static void path_cache_drop(struct path_cache_entry* entry) {
+  pthread_mutex_lock(&index_lock);
+  path_cache_unlink_deps(entry);
+  pthread_mutex_unlock(&index_lock);
+  path_cache_free(entry);
+}
+
+// Under the index lock. Cached entries are detached onto dropped, their
+// deps are unlinked once the index is not walked anymore. The ones on
+// their way in are told not to make it.
+static void path_cache_invalidate(struct path_cache_entry* entry, struct path_cache_entry** dropped) {
+  struct path_cache_shard* shard = &shards[entry->hash & (PATH_CACHE_SHARDS - 1)];
+  pthread_mutex_lock(&shard->lock);
+  if (entry->cached) {
+    path_cache_detach(shard, entry);
+    entry->next = *dropped;
+    *dropped = entry;
+  } else {
+    entry->invalidated = true;
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+static void path_cache_match(const struct inotify_event* event, const char* name, size_t name_len, struct path_cache_entry** dropped) {
+  unsigned int hash = path_cache_dep_hash(event->wd, name, name_len);
+  for (struct path_cache_dep* dep = index_buckets[hash & (PATH_CACHE_INDEX_BUCKETS - 1)]; dep != NULL; dep = dep->next) {
+    if (dep->hash != hash || dep->wd != event->wd || ! (dep->mask & event->mask)) {
+      continue;
+    }
+    if (name == NULL ? dep->name == NULL : dep->name != NULL && dep->name_len == name_len && memcmp(dep->name, name, name_len) == 0) {
+      path_cache_invalidate(dep->entry, dropped);
+    }
+  }
+}
+
+static void path_cache_on_event(const struct inotify_event* event, void* arg) {
+  struct path_cache_entry* dropped = NULL;
+
+  pthread_mutex_lock(&index_lock);
+  unsigned int seq = atomic_fetch_add(&events, 1) + 1;
+  if (event->wd == -1) {
+    last_overflow = seq;
+    for (int i = 0; i < PATH_CACHE_INDEX_BUCKETS; i++) {
+      for (struct path_cache_dep* dep = index_buckets[i]; dep != NULL; dep = dep->next) {
+        path_cache_invalidate(dep->entry, &dropped);
+      }
+    }
+  } else {
+    struct path_cache_watch* watch = path_cache_get_watch(event->wd, seq);
+    if (watch != NULL) {
+      watch->last_event = seq;
+      watch->gone = watch->gone || (event->mask & IN_IGNORED);
+    }
+    if (event->mask & (IN_IGNORED | PATH_CACHE_SELF_MASK)) {
+      // everything found through it
+      for (struct path_cache_dep* dep = watch != NULL ? watch->deps : NULL; dep != NULL; dep = dep->watch_next) {
+        path_cache_invalidate(dep->entry, &dropped);
+      }
+    } else {
+      path_cache_match(event, NULL, 0, &dropped);
+      if (event->len > 0) {
+        path_cache_match(event, event->name, strlen(event->name), &dropped);
+      }
+    }
+  }
+  for (struct path_cache_entry* entry = dropped; entry != NULL; entry = entry->next) {
+    path_cache_unlink_deps(entry);
+  }
+  if (event->mask & IN_IGNORED) {
+    path_cache_forget_watch(event->wd);
+  }
+  pthread_mutex_unlock(&index_lock);
+
+  path_cache_free_list(dropped);
+}
+
+void path_cache_init(const char* root_path, size_t max_entries) {
+  for (int i = 0; i < PATH_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+  root = root_path;
+  root_len = strlen(root_path);
+  max_per_shard = max_entries / PATH_CACHE_SHARDS;
+  if (max_per_shard > 0) {
+    fs_watch_listen(path_cache_on_event, NULL);
+  }
+}
+
+static bool path_cache_inside_root(const char* resolved) {
+  if (strncmp(resolved, root, root_len) != 0) {
+    return false;
+  }
+  // "/srv/www2" is not inside "/srv/www"
+  return resolved[root_len] == '\0' || resolved[root_len] == '/' || root[root_len - 1] == '/';
+}
+
+static void path_cache_lookup_fs(const char* path, struct path_resolution* res) {
+  memset(res, 0, offsetof(struct path_resolution, resolved));
+  if (realpath(path, res->resolved) == NULL) {
+    res->error = errno;
+    res->resolved[0] = '\0';
+    return;
+  }
+  res->inside_root = path_cache_inside_root(res->resolved);
+  if (stat(res->resolved, &res->st) == -1) {
+    res->error = errno;
+  }
+}
+
+static void path_cache_add_dep(struct path_cache_entry* entry, const char* watched, uint32_t watch_mask, const char* name, size_t name_len, uint32_t mask) {
+  if (entry->nb_deps == PATH_CACHE_DEPS) {
+    entry->unwatched = true;
+    return;
+  }
+  int wd = fs_watch_add(watched, watch_mask);
+  if (wd == -1) {
+    // a directory that does not exist is covered by its parent, where its
+    // name would appear
+    if (errno != ENOENT && errno != ENOTDIR) {
+      entry->unwatched = true;
+    }
+    return;
+  }
+  struct path_cache_dep* dep = &entry->deps[entry->nb_deps++];
+  dep->entry = entry;
+  dep->watch = NULL;
+  dep->wd = wd;
+  dep->mask = mask;
+  dep->name = name;
+  dep->name_len = name_len;
+  dep->hash = path_cache_dep_hash(wd, name, name_len);
+}
+
+// Watches what the resolution depends on: the resolved file itself, the
+// name it has in its directory and every name on the requested path, one
+// of them may be replaced, renamed or turned into a symlink. Past
+// PATH_CACHE_DEPS, the expiration covers the shallowest ones.
+static void path_cache_watch(struct path_cache_entry* entry) {
+  char dir[PATH_MAX];
+
+  if (entry->error == 0) {
+    if (S_ISDIR(entry->st.st_mode)) {
+      // names coming and going change its stat and its listing
+      path_cache_add_dep(entry, entry->resolved, PATH_CACHE_DIR_MASK | IN_ONLYDIR, NULL, 0, PATH_CACHE_DIR_MASK);
+    } else {
+      path_cache_add_dep(entry, entry->resolved, PATH_CACHE_FILE_MASK, NULL, 0, PATH_CACHE_FILE_MASK);
+    }
+    const char* slash = strrchr(entry->resolved, '/');
+    if (slash[1] != '\0') {
+      memcpy(dir, entry->resolved, slash - entry->resolved);
+      dir[slash - entry->resolved] = '\0';
+      path_cache_add_dep(entry, slash == entry->resolved ? "/" : dir, PATH_CACHE_DIR_MASK | IN_ONLYDIR,
+                         slash + 1, strlen(slash + 1), PATH_CACHE_NAME_MASK);
+    }
+  }
+
+  size_t len = strlen(entry->path);
+  if (len >= sizeof(dir)) {
+    return;
+  }
+  memcpy(dir, entry->path, len + 1);
+  // paths are relative to the served directory, "." being its root. The
+  // names that do not exist (yet) are in directories that do not either,
+  // creating them shows up in their closest existing ancestor.
+  while (strcmp(dir, ".") != 0) {
+    char* slash = strrchr(dir, '/');
+    size_t start = slash == NULL ? 0 : slash + 1 - dir;
+    const char* name = entry->path + start;
+    size_t name_len = len - start;
+    if (slash == NULL) {
+      strcpy(dir, ".");
+    } else {
+      *slash = '\0';
+    }
+    len = start > 0 ? start - 1 : 0;
+    if (name_len == 0 || (name_len == 1 && name[0] == '.')) {
+      continue;
+    }
+    // a symlink is not followed, what matters is the directory holding
+    // it, watched next
+    path_cache_add_dep(entry, dir, PATH_CACHE_DIR_MASK | IN_ONLYDIR | IN_DONT_FOLLOW, name, name_len, PATH_CACHE_NAME_MASK);
+  }
+}
+
+static void path_cache_insert(struct path_cache_shard* shard, const char* path, unsigned int hash, const struct path_resolution* res, unsigned int seq) {
+  size_t resolved_len = strlen(res->resolved);
+  struct path_cache_entry* entry = malloc(sizeof(struct path_cache_entry) + resolved_len + 1);
+  if (entry == NULL) {
+    return;
+  }
+  entry->path = strdup(path);
+  if (entry->path == NULL) {
+    free(entry);
+    return;
+  }
+  entry->hash = hash;
+  entry->unwatched = false;
+  entry->cached = false;
+  entry->invalidated = false;
+  entry->nb_deps = 0;
+  entry->error = res->error;
+  entry->inside_root = res->inside_root;
+  entry->st = res->st;
+  entry->resolved_len = resolved_len;
+  memcpy(entry->resolved, res->resolved, resolved_len + 1);
+  entry->lru_prev = entry->lru_next = NULL;
+  path_cache_watch(entry);
+  // events tell when a watched resolution changes, the others expire
+  entry->expires_ms = entry->unwatched ? now_ms() + PATH_CACHE_TTL_MS : ULLONG_MAX;
+
+  // something it depends on changed while resolving
+  pthread_mutex_lock(&index_lock);
+  bool changed = path_cache_after(last_overflow, seq);
+  for (int i = 0; i < entry->nb_deps; i++) {
+    struct path_cache_watch* watch = path_cache_get_watch(entry->deps[i].wd, seq);
+    if (watch == NULL || watch->gone || path_cache_after(watch->last_event, seq)) {
+      changed = true;
+    }
+    if (watch != NULL) {
+      path_cache_link_dep(&entry->deps[i], watch);
+    }
+  }
+  pthread_mutex_unlock(&index_lock);
+  if (changed) {
+    path_cache_drop(entry);
+    return;
+  }
+
+  struct path_cache_entry* dropped = NULL;
+  pthread_mutex_lock(&shard->lock);
+  if (entry->invalidated) {
+    // and since
+    pthread_mutex_unlock(&shard->lock);
+    path_cache_drop(entry);
+    return;
+  }
+  struct path_cache_entry** bucket = &shard->buckets[hash & (PATH_CACHE_BUCKETS - 1)];
+  for (struct path_cache_entry* other = *bucket; other != NULL; other = other->next) {
+    if (other->hash == hash && strcmp(other->path, path) == 0) {
+      // resolved by another loop meanwhile
+      path_cache_detach(shard, other);
+      dropped = other;
+      break;
+    }
+  }
+  if (dropped == NULL && shard->count >= max_per_shard) {
+    dropped = shard->lru_tail;
+    path_cache_detach(shard, dropped);
+  }
+  entry->next = *bucket;
+  *bucket = entry;
+  path_cache_lru_push(shard, entry);
+  entry->cached = true;
+  shard->count++;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (dropped != NULL) {
+    path_cache_drop(dropped);
+  }
+}
+
+void path_cache_resolve(const char* path, struct path_resolution* res) {
+  if (max_per_shard == 0) {
+    path_cache_lookup_fs(path, res);
+    return;
+  }
+
+  unsigned int hash = path_cache_hash(path);
+  struct path_cache_shard* shard = &shards[hash & (PATH_CACHE_SHARDS - 1)];
+  struct path_cache_entry* expired = NULL;
+
+  pthread_mutex_lock(&shard->lock);
+  struct path_cache_entry* entry;
+  for (entry = shard->buckets[hash & (PATH_CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+      break;
+    }
+  }
+  if (entry != NULL) {
+    if (now_ms() < entry->expires_ms) {
+      res->error = entry->error;
+      res->inside_root = entry->inside_root;
+      res->st = entry->st;
+      memcpy(res->resolved, entry->resolved, entry->resolved_len + 1);
+      path_cache_lru_unlink(shard, entry);
+      path_cache_lru_push(shard, entry);
+      pthread_mutex_unlock(&shard->lock);
+      return;
+    }
+    path_cache_detach(shard, entry);
+    expired = entry;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (expired != NULL) {
+    path_cache_drop(expired);
+  }
+
+  unsigned int seq = atomic_load(&events);
+  path_cache_lookup_fs(path, res);
+  // other errors may be transient
+  if (res->error == 0 || res->error == ENOENT || res->error == ENOTDIR) {
+    path_cache_insert(shard, path, hash, res, seq);
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef PATH_CACHE_HEADER
+#define PATH_CACHE_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define PATH_CACHE_SHARDS 16 // power of 2
+#define PATH_CACHE_MAX_ENTRIES 8192
+// resolutions are kept until inotify reports a change to what they depend
+// on. Those it cannot watch (no inotify, out of watches, paths too deep)
+// are only trusted this long.
+#define PATH_CACHE_TTL_MS 2000
+
+struct path_resolution {
+  int error;        // errno from resolving or stat-ing the path, 0 if it exists
+  bool inside_root; // false when the path escapes the served directory
+  struct stat st;
+  char resolved[PATH_MAX];
+};
+
+// Resolves paths against the current directory, root is its real path.
+// Keeps up to max_entries resolutions, 0 to disable the cache. Registers
+// an fs_watch listener, so must be called before fs_watch_start.
+void path_cache_init(const char* root, size_t max_entries);
+
+// realpath and stat of path, relative to the current directory, plus the
+// check it stays inside root. Served from the cache when possible.
+void path_cache_resolve(const char* path, struct path_resolution* res);
+
+#endif
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pool.h"
+
+// Takes the first cache line of the slab, the objects follow
+struct pool_slab {
+  struct pool_slab* next;
+};
+
+void pool_init(struct pool* pool, size_t object_size) {
+  if (object_size < sizeof(void*)) {
+    object_size = sizeof(void*);
+  }
+  pool->object_size = (object_size + POOL_ALIGN - 1) & ~((size_t) POOL_ALIGN - 1);
+  pool->free_list = NULL;
+  pool->slabs = NULL;
+}
+
+void pool_destroy(struct pool* pool) {
+  struct pool_slab* slab = pool->slabs;
+  while (slab != NULL) {
+    struct pool_slab* next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+}
+
+static int pool_add_slab(struct pool* pool) {
+  void* mem;
+  int err = posix_memalign(&mem, POOL_ALIGN, POOL_ALIGN + POOL_SLAB_OBJECTS * pool->object_size);
+  if (err != 0) {
+    errno = err;
+    perror("posix_memalign");
+    return -1;
+  }
+  struct pool_slab* slab = mem;
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  // threaded in address order, the first object is handed out first
+  char* objects = (char*) mem + POOL_ALIGN;
+  for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+    void* object = objects + i * pool->object_size;
+    memcpy(object, &pool->free_list, sizeof(void*));
+    pool->free_list = object;
+  }
+  return 0;
+}
+
+void* pool_get(struct pool* pool) {
+  if (pool->free_list == NULL && pool_add_slab(pool) == -1) {
+    return NULL;
+  }
+  void* object = pool->free_list;
+  memcpy(&pool->free_list, object, sizeof(void*));
+  return object;
+}
+
+void pool_put(struct pool* pool, void* object) {
+  memcpy(object, &pool->free_list, sizeof(void*));
+  pool->free_list = object;
+}
@@ -0,0 +1,28 @@
+#ifndef POOL_HEADER
+#define POOL_HEADER
+
+#include <stddef.h>
+
+#define POOL_ALIGN 64 // cache line, objects never share one
+#define POOL_SLAB_OBJECTS 32
+
+struct pool_slab;
+
+// Fixed size objects carved out of slabs, for a single thread. Freed
+// objects are kept for reuse, the most recently freed first as it is the
+// most likely to still be in cache. Slabs are only given back when the
+// pool is destroyed.
+struct pool {
+  size_t object_size; // rounded up to POOL_ALIGN
+  void* free_list;
+  struct pool_slab* slabs;
+};
+
+void pool_init(struct pool* pool, size_t object_size);
+void pool_destroy(struct pool* pool);
+
+// Uninitialized, NULL when out of memory.
+void* pool_get(struct pool* pool);
+void pool_put(struct pool* pool, void* object);
+
+#endif
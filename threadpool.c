@@ -31,12 +31,25 @@
  * @brief Threadpool implementation file
  */
 
+#define _GNU_SOURCE 1
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "threadpool.h"
 
+#define CACHE_LINE_SIZE 64
+
 typedef enum {
     immediate_shutdown = 1,
     graceful_shutdown  = 2
@@ -55,86 +68,405 @@ typedef struct {
     void *argument;
 } threadpool_task_t;
 
+/**
+ *  @struct threadpool_slot
+ *  @brief a cell of the task queue
+ *
+ *  @var sequence Position the cell is ready for: equal to the enqueue
+ *                position when free, to the dequeue position + 1 when it
+ *                holds a task.
+ *  @var task     The task itself.
+ */
+typedef struct {
+    atomic_size_t sequence;
+    threadpool_task_t task;
+} threadpool_slot_t;
+
+/**
+ *  @struct threadpool_deque_slot
+ *  @brief a cell of a work-stealing deque
+ *
+ *  Thieves may read a cell while its owner rewrites it; they then fail
+ *  to claim it, but the accesses themselves have to be atomic.
+ */
+typedef struct {
+    _Atomic(void (*)(void *)) function;
+    _Atomic(void *) argument;
+} threadpool_deque_slot_t;
+
+/**
+ *  @struct threadpool_worker
+ *  @brief per worker state
+ *
+ *  @var pool   The pool which own the worker.
+ *  @var thread Worker thread ID.
+ *  @var cpu    CPU the worker is pinned to, -1 if not pinned.
+ *  @var node   NUMA node of that CPU, -1 if not pinned or unknown.
+ *  @var deque  Bounded Chase-Lev deque of the worker, in work-stealing
+ *              mode only. The owner pushes and takes at the bottom,
+ *              other workers steal from the top. Mapped untouched, the
+ *              worker touches it first so it lands on its own node.
+ *  @var top    Index of the oldest task, advanced by thieves.
+ *  @var bottom Index past the newest task, only written by the owner.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) threadpool_t *pool;
+    pthread_t thread;
+    int cpu;
+    int node;
+    threadpool_deque_slot_t *deque;
+    _Alignas(CACHE_LINE_SIZE) atomic_long top;
+    _Alignas(CACHE_LINE_SIZE) atomic_long bottom;
+} threadpool_worker_t;
+
 /**
  *  @struct threadpool
  *  @brief The threadpool struct
  *
- *  @var notify       Condition variable to notify worker threads.
- *  @var threads      Array containing worker threads ID.
+ *  @var workers      Array containing the workers.
  *  @var thread_count Number of threads
- *  @var queue        Array containing the task queue.
- *  @var queue_size   Size of the task queue.
- *  @var head         Index of the first element.
- *  @var tail         Index of the next element.
- *  @var count        Number of pending tasks
+ *  @var worker_count Number of workers, set before any thread starts.
+ *  @var flags        Flags given to threadpool_create.
+ *  @var queue        Array containing the task queue, a bounded lock-free
+ *                    multi-producer multi-consumer ring (D. Vyukov).
+ *                    In work-stealing mode, only tasks added from outside
+ *                    of the pool go through it.
+ *  @var queue_size   Size of the task queue and of each deque, a power
+ *                    of two.
+ *  @var tail         Position of the next enqueue.
+ *  @var head         Position of the next dequeue.
+ *  @var idle         Number of workers going to sleep or sleeping.
+ *  @var wakeup       Futex the idle workers sleep on, bumped to wake them.
  *  @var shutdown     Flag indicating if the pool is shutting down
  *  @var started      Number of started threads
  */
 struct threadpool_t {
-  pthread_mutex_t lock;
-  pthread_cond_t notify;
-  pthread_t *threads;
-  threadpool_task_t *queue;
+  threadpool_worker_t *workers;
+  threadpool_slot_t *queue;
   int thread_count;
+  int worker_count;
+  int flags;
   int queue_size;
-  int head;
-  int tail;
-  int count;
-  int shutdown;
-  int started;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+  _Alignas(CACHE_LINE_SIZE) atomic_int idle;
+  _Atomic uint32_t wakeup;
+  atomic_int shutdown;
+  atomic_int started;
 };
 
+/* The worker running on the current thread, if any */
+static __thread threadpool_worker_t *current_worker;
+
 /**
- * @function void *threadpool_thread(void *threadpool)
+ * @function void *threadpool_thread(void *worker)
  * @brief the worker thread
- * @param threadpool the pool which own the thread
+ * @param worker the worker state, which points to the pool owning it
  */
-static void *threadpool_thread(void *threadpool);
+static void *threadpool_thread(void *worker);
 
 int threadpool_free(threadpool_t *pool);
 
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected)
+{
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int count)
+{
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static int threadpool_enqueue(threadpool_t *pool, threadpool_task_t task)
+{
+    size_t mask = pool->queue_size - 1;
+    size_t pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+
+    for(;;) {
+        threadpool_slot_t *slot = &pool->queue[pos & mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&pool->tail, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+                slot->task = task;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if(diff < 0) {
+            /* The slot still holds a task from the previous lap */
+            return threadpool_queue_full;
+        } else {
+            pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static int threadpool_dequeue(threadpool_t *pool, threadpool_task_t *task)
+{
+    size_t mask = pool->queue_size - 1;
+    size_t pos = atomic_load_explicit(&pool->head, memory_order_relaxed);
+
+    for(;;) {
+        threadpool_slot_t *slot = &pool->queue[pos & mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&pool->head, &pos, pos + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+                *task = slot->task;
+                atomic_store_explicit(&slot->sequence, pos + mask + 1, memory_order_release);
+                return 1;
+            }
+        } else if(diff < 0) {
+            /* Empty */
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&pool->head, memory_order_relaxed);
+        }
+    }
+}
+
+/* Deque operations, after Le, Pop, Cohen and Zappa Nardelli, "Correct and
+   Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013). */
+
+static int threadpool_deque_push(threadpool_worker_t *worker, threadpool_task_t task)
+{
+    long mask = worker->pool->queue_size - 1;
+    long b = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&worker->top, memory_order_acquire);
+
+    if(b - t > mask) {
+        return threadpool_queue_full;
+    }
+    threadpool_deque_slot_t *slot = &worker->deque[b & mask];
+    atomic_store_explicit(&slot->function, task.function, memory_order_relaxed);
+    atomic_store_explicit(&slot->argument, task.argument, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+static int threadpool_deque_take(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+    long mask = worker->pool->queue_size - 1;
+    long b = atomic_load_explicit(&worker->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&worker->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&worker->top, memory_order_relaxed);
+
+    if(t > b) {
+        /* Empty */
+        atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+
+    threadpool_deque_slot_t *slot = &worker->deque[b & mask];
+    task->function = atomic_load_explicit(&slot->function, memory_order_relaxed);
+    task->argument = atomic_load_explicit(&slot->argument, memory_order_relaxed);
+    if(t == b) {
+        /* Last task: race the thieves for it */
+        int won = atomic_compare_exchange_strong_explicit(&worker->top, &t, t + 1,
+                                                          memory_order_seq_cst,
+                                                          memory_order_relaxed);
+        atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+static int threadpool_deque_steal(threadpool_worker_t *victim, threadpool_task_t *task)
+{
+    long mask = victim->pool->queue_size - 1;
+    long t = atomic_load_explicit(&victim->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+
+    if(t >= b) {
+        return 0;
+    }
+    threadpool_deque_slot_t *slot = &victim->deque[t & mask];
+    task->function = atomic_load_explicit(&slot->function, memory_order_relaxed);
+    task->argument = atomic_load_explicit(&slot->argument, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&victim->top, &t, t + 1,
+                                                   memory_order_seq_cst,
+                                                   memory_order_relaxed);
+}
+
+/**
+ * @function threadpool_cpu_node
+ * @brief NUMA node of a CPU, as exposed in sysfs.
+ * @return the node, or -1 if unknown.
+ */
+static int threadpool_cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *entry;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if(dir == NULL) {
+        return -1;
+    }
+    while((entry = readdir(dir)) != NULL) {
+        if(sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+        node = -1;
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * @function threadpool_next_task
+ * @brief Looks for a task: in the worker own deque first, then in the
+ * shared queue, then in the deques of the other workers.
+ * @return 1 if a task was found.
+ */
+static int threadpool_next_task(threadpool_worker_t *self, threadpool_task_t *task)
+{
+    threadpool_t *pool = self->pool;
+
+    if(!(pool->flags & threadpool_work_stealing)) {
+        return threadpool_dequeue(pool, task);
+    }
+
+    if(threadpool_deque_take(self, task) || threadpool_dequeue(pool, task)) {
+        return 1;
+    }
+
+    /* Start from our right neighbour so thieves spread over victims */
+    int index = self - pool->workers;
+    for(int i = 1; i < pool->worker_count; i++) {
+        threadpool_worker_t *victim = &pool->workers[(index + i) % pool->worker_count];
+        /* A lost race means there may be more: try that victim again */
+        while(atomic_load_explicit(&victim->top, memory_order_relaxed) <
+              atomic_load_explicit(&victim->bottom, memory_order_relaxed)) {
+            if(threadpool_deque_steal(victim, task)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
 threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
 {
     threadpool_t *pool;
     int i;
-    (void) flags;
 
     if(thread_count <= 0 || thread_count > MAX_THREADS || queue_size <= 0 || queue_size > MAX_QUEUE) {
         return NULL;
     }
 
-    if((pool = (threadpool_t *)malloc(sizeof(threadpool_t))) == NULL) {
+    if((pool = (threadpool_t *)aligned_alloc(CACHE_LINE_SIZE, sizeof(threadpool_t))) == NULL) {
         goto err;
     }
 
+    /* The rings index with a mask */
+    int size = 1;
+    while(size < queue_size) {
+        size <<= 1;
+    }
+
     /* Initialize */
     pool->thread_count = 0;
-    pool->queue_size = queue_size;
-    pool->head = pool->tail = pool->count = 0;
-    pool->shutdown = pool->started = 0;
-
-    /* Allocate thread and task queue */
-    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * thread_count);
-    pool->queue = (threadpool_task_t *)malloc
-        (sizeof(threadpool_task_t) * queue_size);
-
-    /* Initialize mutex and conditional variable first */
-    if((pthread_mutex_init(&(pool->lock), NULL) != 0) ||
-       (pthread_cond_init(&(pool->notify), NULL) != 0) ||
-       (pool->threads == NULL) ||
+    pool->worker_count = thread_count;
+    pool->flags = flags;
+    pool->queue_size = size;
+    atomic_init(&pool->head, 0);
+    atomic_init(&pool->tail, 0);
+    atomic_init(&pool->idle, 0);
+    atomic_init(&pool->wakeup, 0);
+    atomic_init(&pool->shutdown, 0);
+    atomic_init(&pool->started, 0);
+
+    /* Allocate workers and task queue */
+    pool->workers = (threadpool_worker_t *)aligned_alloc
+        (CACHE_LINE_SIZE, sizeof(threadpool_worker_t) * thread_count);
+    pool->queue = (threadpool_slot_t *)malloc
+        (sizeof(threadpool_slot_t) * size);
+
+    if((pool->workers == NULL) ||
        (pool->queue == NULL)) {
+        free(pool->workers);
+        pool->workers = NULL;
         goto err;
     }
 
-    /* Start worker threads */
+    for(i = 0; i < size; i++) {
+        atomic_init(&pool->queue[i].sequence, i);
+    }
+
+    for(i = 0; i < thread_count; i++) {
+        threadpool_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->cpu = -1;
+        worker->node = -1;
+        worker->deque = NULL;
+        atomic_init(&worker->top, 0);
+        atomic_init(&worker->bottom, 0);
+    }
+    if(flags & threadpool_work_stealing) {
+        for(i = 0; i < thread_count; i++) {
+            void *deque = mmap(NULL, sizeof(threadpool_deque_slot_t) * size,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(deque == MAP_FAILED) {
+                goto err;
+            }
+            pool->workers[i].deque = deque;
+        }
+    }
+
+    /* Worker i gets the i-th CPU we are allowed to run on, wrapping
+       around when there are more workers than CPUs */
+    cpu_set_t allowed;
+    int nb_allowed = 0;
+    if(flags & threadpool_pin_workers) {
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            goto err;
+        }
+        nb_allowed = CPU_COUNT(&allowed);
+    }
+    for(i = 0; i < thread_count && nb_allowed > 0; i++) {
+        int n = i % nb_allowed;
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &allowed) && n-- == 0) {
+                pool->workers[i].cpu = cpu;
+                pool->workers[i].node = threadpool_cpu_node(cpu);
+                break;
+            }
+        }
+    }
+
+    /* Start worker threads, already on their CPU if pinned */
     for(i = 0; i < thread_count; i++) {
-        if(pthread_create(&(pool->threads[i]), NULL,
-                          threadpool_thread, (void*)pool) != 0) {
+        pthread_attr_t attr;
+        int ret;
+
+        pthread_attr_init(&attr);
+        if(pool->workers[i].cpu != -1) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(pool->workers[i].cpu, &cpuset);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        }
+        ret = pthread_create(&(pool->workers[i].thread), &attr,
+                             threadpool_thread, (void*)&pool->workers[i]);
+        pthread_attr_destroy(&attr);
+        if(ret != 0) {
             threadpool_destroy(pool, 0);
             return NULL;
         }
         pool->thread_count++;
-        pool->started++;
+        atomic_fetch_add(&pool->started, 1);
     }
 
     return pool;
@@ -149,89 +481,68 @@ threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
 int threadpool_add(threadpool_t *pool, void (*function)(void *),
                    void *argument, int flags)
 {
-    int err = 0;
-    int next;
+    int err = threadpool_queue_full;
+    threadpool_task_t task;
+    threadpool_worker_t *self = current_worker;
     (void) flags;
 
     if(pool == NULL || function == NULL) {
         return threadpool_invalid;
     }
 
-    if(pthread_mutex_lock(&(pool->lock)) != 0) {
-        return threadpool_lock_failure;
+    /* Are we shutting down ? */
+    if(atomic_load_explicit(&pool->shutdown, memory_order_relaxed)) {
+        return threadpool_shutdown;
     }
 
-    next = (pool->tail + 1) % pool->queue_size;
-
-    do {
-        /* Are we full ? */
-        if(pool->count == pool->queue_size) {
-            err = threadpool_queue_full;
-            break;
-        }
-
-        /* Are we shutting down ? */
-        if(pool->shutdown) {
-            err = threadpool_shutdown;
-            break;
-        }
+    task.function = function;
+    task.argument = argument;
 
-        /* Add task to queue */
-        pool->queue[pool->tail].function = function;
-        pool->queue[pool->tail].argument = argument;
-        pool->tail = next;
-        pool->count += 1;
-
-        /* pthread_cond_broadcast */
-        if(pthread_cond_signal(&(pool->notify)) != 0) {
-            err = threadpool_lock_failure;
-            break;
-        }
-    } while(0);
+    /* Tasks added by a worker stay on its core, unless its deque is full */
+    if((pool->flags & threadpool_work_stealing) && self != NULL && self->pool == pool) {
+        err = threadpool_deque_push(self, task);
+    }
+    if(err != 0 && (err = threadpool_enqueue(pool, task)) != 0) {
+        return err;
+    }
 
-    if(pthread_mutex_unlock(&pool->lock) != 0) {
-        err = threadpool_lock_failure;
+    /* Pairs with the idle increment of a worker about to sleep: either
+       it sees the task, or we see it idle and wake it up. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&pool->wakeup, 1);
+        futex_wake(&pool->wakeup, 1);
     }
 
-    return err;
+    return 0;
 }
 
 int threadpool_destroy(threadpool_t *pool, int flags)
 {
     int i, err = 0;
+    int expected = 0;
 
     if(pool == NULL) {
         return threadpool_invalid;
     }
 
-    if(pthread_mutex_lock(&(pool->lock)) != 0) {
-        return threadpool_lock_failure;
+    /* Already shutting down */
+    if(!atomic_compare_exchange_strong(&pool->shutdown, &expected,
+                                       (flags & threadpool_graceful) ?
+                                       graceful_shutdown : immediate_shutdown)) {
+        return threadpool_shutdown;
     }
 
-    do {
-        /* Already shutting down */
-        if(pool->shutdown) {
-            err = threadpool_shutdown;
-            break;
-        }
-
-        pool->shutdown = (flags & threadpool_graceful) ?
-            graceful_shutdown : immediate_shutdown;
+    /* Wake up all worker threads */
+    atomic_fetch_add(&pool->wakeup, 1);
+    futex_wake(&pool->wakeup, INT_MAX);
 
-        /* Wake up all worker threads */
-        if((pthread_cond_broadcast(&(pool->notify)) != 0) ||
-           (pthread_mutex_unlock(&(pool->lock)) != 0)) {
-            err = threadpool_lock_failure;
-            break;
-        }
-
-        /* Join all worker thread */
-        for(i = 0; i < pool->thread_count; i++) {
-            if(pthread_join(pool->threads[i], NULL) != 0) {
-                err = threadpool_thread_failure;
-            }
+    /* Join all worker thread */
+    for(i = 0; i < pool->thread_count; i++) {
+        if(pthread_join(pool->workers[i].thread, NULL) != 0) {
+            err = threadpool_thread_failure;
         }
-    } while(0);
+    }
 
     /* Only if everything went well do we deallocate the pool */
     if(!err) {
@@ -240,66 +551,89 @@ int threadpool_destroy(threadpool_t *pool, int flags)
     return err;
 }
 
+int threadpool_worker_cpu(threadpool_t *pool, int worker)
+{
+    if(pool == NULL || worker < 0 || worker >= pool->worker_count) {
+        return -1;
+    }
+    return pool->workers[worker].cpu;
+}
+
+int threadpool_worker_node(threadpool_t *pool, int worker)
+{
+    if(pool == NULL || worker < 0 || worker >= pool->worker_count) {
+        return -1;
+    }
+    return pool->workers[worker].node;
+}
+
 int threadpool_free(threadpool_t *pool)
 {
-    if(pool == NULL || pool->started > 0) {
+    if(pool == NULL || atomic_load(&pool->started) > 0) {
         return -1;
     }
 
-    /* Did we manage to allocate ? */
-    if(pool->threads) {
-        free(pool->threads);
-        free(pool->queue);
- 
-        /* Because we allocate pool->threads after initializing the
-           mutex and condition variable, we're sure they're
-           initialized. Let's lock the mutex just in case. */
-        pthread_mutex_lock(&(pool->lock));
-        pthread_mutex_destroy(&(pool->lock));
-        pthread_cond_destroy(&(pool->notify));
+    if(pool->workers) {
+        for(int i = 0; i < pool->worker_count; i++) {
+            if(pool->workers[i].deque) {
+                munmap(pool->workers[i].deque, sizeof(threadpool_deque_slot_t) * pool->queue_size);
+            }
+        }
+        free(pool->workers);
     }
+    free(pool->queue);
     free(pool);    
     return 0;
 }
 
 
-static void *threadpool_thread(void *threadpool)
+static void *threadpool_thread(void *worker)
 {
-    threadpool_t *pool = (threadpool_t *)threadpool;
+    threadpool_worker_t *self = (threadpool_worker_t *)worker;
+    threadpool_t *pool = self->pool;
     threadpool_task_t task;
 
+    current_worker = self;
+    if(self->deque) {
+        /* First touch, from the worker CPU */
+        memset(self->deque, 0, sizeof(threadpool_deque_slot_t) * pool->queue_size);
+    }
+
     for(;;) {
-        /* Lock must be taken to wait on conditional variable */
-        pthread_mutex_lock(&(pool->lock));
+        int shutdown = atomic_load(&pool->shutdown);
+        if(shutdown == immediate_shutdown) {
+            break;
+        }
 
-        /* Wait on condition variable, check for spurious wakeups.
-           When returning from pthread_cond_wait(), we own the lock. */
-        while((pool->count == 0) && (!pool->shutdown)) {
-            pthread_cond_wait(&(pool->notify), &(pool->lock));
+        if(threadpool_next_task(self, &task)) {
+            /* Get to work */
+            (*(task.function))(task.argument);
+            continue;
         }
 
-        if((pool->shutdown == immediate_shutdown) ||
-           ((pool->shutdown == graceful_shutdown) &&
-            (pool->count == 0))) {
+        if(shutdown == graceful_shutdown) {
             break;
         }
 
-        /* Grab our task */
-        task.function = pool->queue[pool->head].function;
-        task.argument = pool->queue[pool->head].argument;
-        pool->head = (pool->head + 1) % pool->queue_size;
-        pool->count -= 1;
-
-        /* Unlock */
-        pthread_mutex_unlock(&(pool->lock));
-
-        /* Get to work */
-        (*(task.function))(task.argument);
+        /* Nothing to do: announce we are going to sleep, then check the
+           queues again so a task added meanwhile is not missed. Only this
+           path makes a syscall. */
+        uint32_t wakeup = atomic_load(&pool->wakeup);
+        atomic_fetch_add(&pool->idle, 1);
+        if(threadpool_next_task(self, &task)) {
+            atomic_fetch_sub(&pool->idle, 1);
+            (*(task.function))(task.argument);
+            continue;
+        }
+        if(!atomic_load(&pool->shutdown)) {
+            futex_wait(&pool->wakeup, wakeup);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
     }
 
-    pool->started--;
+    current_worker = NULL;
+    atomic_fetch_sub(&pool->started, 1);
 
-    pthread_mutex_unlock(&(pool->lock));
     pthread_exit(NULL);
     return(NULL);
 }
@@ -55,6 +55,11 @@ typedef enum {
     threadpool_thread_failure = -5
 } threadpool_error_t;
 
+typedef enum {
+    threadpool_work_stealing  = 1,
+    threadpool_pin_workers    = 2
+} threadpool_create_flags_t;
+
 typedef enum {
     threadpool_graceful       = 1
 } threadpool_destroy_flags_t;
@@ -64,8 +69,16 @@ typedef enum {
  * @brief Creates a threadpool_t object.
  * @param thread_count Number of worker threads.
  * @param queue_size   Size of the queue.
- * @param flags        Unused parameter.
+ * @param flags        Flags for the scheduling mode
  * @return a newly created thread pool or NULL
+ *
+ * Known values for flags are 0 (default), a single queue shared by all
+ * workers, and threadpool_work_stealing, in which case every worker
+ * also gets a deque of queue_size tasks: tasks added from a worker go
+ * to its own deque, and idle workers steal from the others.
+ * threadpool_pin_workers can be added to pin each worker to one of the
+ * CPUs the process is allowed to run on, in order; memory the worker
+ * touches first is then allocated on its NUMA node.
  */
 threadpool_t *threadpool_create(int thread_count, int queue_size, int flags);
 
@@ -82,6 +95,25 @@ threadpool_t *threadpool_create(int thread_count, int queue_size, int flags);
 int threadpool_add(threadpool_t *pool, void (*routine)(void *),
                    void *arg, int flags);
 
+/**
+ * @function threadpool_worker_cpu
+ * @brief CPU a worker is pinned to.
+ * @param pool   Thread pool of the worker.
+ * @param worker Index of the worker, from 0 to thread_count - 1.
+ * @return the CPU, or -1 if the workers are not pinned.
+ */
+int threadpool_worker_cpu(threadpool_t *pool, int worker);
+
+/**
+ * @function threadpool_worker_node
+ * @brief NUMA node of the CPU a worker is pinned to.
+ * @param pool   Thread pool of the worker.
+ * @param worker Index of the worker, from 0 to thread_count - 1.
+ * @return the node, or -1 if the workers are not pinned or the node is
+ * unknown.
+ */
+int threadpool_worker_node(threadpool_t *pool, int worker);
+
 /**
  * @function threadpool_destroy
  * @brief Stops and destroys a thread pool.
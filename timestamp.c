@@ -0,0 +1,71 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "timestamp.h"
+
+#define TIMESTAMP_CACHE_SIZE 64 // power of 2
+// room for any year, only the usual four digits are ever copied out
+#define TIMESTAMP_BUFF_LEN 64
+
+static const char days[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char months[12][4] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+struct timestamp_entry {
+  time_t t;
+  bool valid;
+  char text[TIMESTAMP_BUFF_LEN];
+};
+
+static __thread time_t http_now_second = -1;
+static __thread char http_now[TIMESTAMP_BUFF_LEN];
+static __thread time_t log_second = -1;
+static __thread char log_text[TIMESTAMP_BUFF_LEN];
+static __thread struct timestamp_entry recent[TIMESTAMP_CACHE_SIZE];
+
+// Without strftime: the names must not depend on the locale
+static void timestamp_format_http(time_t t, char* buff) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  snprintf(buff, TIMESTAMP_BUFF_LEN, "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday,
+           months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+const char* timestamp_http_now(void) {
+  time_t now = time(NULL);
+  if (now != http_now_second) {
+    timestamp_format_http(now, http_now);
+    http_now_second = now;
+  }
+  return http_now;
+}
+
+void timestamp_log(time_t t, char* buff) {
+  if (t != log_second) {
+    // localtime_r takes the time zone lock, once per second is fine
+    struct tm tm;
+    localtime_r(&t, &tm);
+    long offset = tm.tm_gmtoff / 60;
+    char sign = offset < 0 ? '-' : '+';
+    if (offset < 0) {
+      offset = -offset;
+    }
+    snprintf(log_text, sizeof(log_text), "%02d/%s/%04d:%02d:%02d:%02d %c%02ld%02ld", tm.tm_mday, months[tm.tm_mon],
+             tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec, sign, offset / 60, offset % 60);
+    log_second = t;
+  }
+  memcpy(buff, log_text, TIMESTAMP_LOG_LEN + 1);
+}
+
+void timestamp_http(time_t t, char* buff) {
+  struct timestamp_entry* entry = &recent[(unsigned long) t & (TIMESTAMP_CACHE_SIZE - 1)];
+  if (! entry->valid || entry->t != t) {
+    timestamp_format_http(t, entry->text);
+    entry->t = t;
+    entry->valid = true;
+  }
+  memcpy(buff, entry->text, TIMESTAMP_HTTP_LEN + 1);
+}
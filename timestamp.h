@@ -0,0 +1,26 @@
+#ifndef TIMESTAMP_HEADER
+#define TIMESTAMP_HEADER
+
+#include <time.h>
+
+// IMF-fixdate, as in HTTP headers: "Sun, 06 Nov 1994 08:49:37 GMT"
+#define TIMESTAMP_HTTP_LEN 29
+// Common Log Format: "06/Nov/1994:08:49:37 +0000"
+#define TIMESTAMP_LOG_LEN 26
+
+// The current time, formatted again only when the second changes. Each
+// thread keeps its own copy, so reading it takes no lock and shares no
+// cache line; the string stays valid until the thread calls again.
+const char* timestamp_http_now(void);
+
+// Formats t, in local time, for the access log in buff, which must hold
+// TIMESTAMP_LOG_LEN + 1 bytes. Log records come in time order, so only
+// the last second is remembered.
+void timestamp_log(time_t t, char* buff);
+
+// Formats t as an IMF-fixdate in buff, which must hold
+// TIMESTAMP_HTTP_LEN + 1 bytes. Recent values are remembered per thread,
+// as the same few file dates are formatted over and over.
+void timestamp_http(time_t t, char* buff);
+
+#endif
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int uring_init(struct uring* ring, unsigned int entries) {
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+
+  struct io_uring_params p = {0};
+  // completions of multishot requests can outnumber submissions
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  p.cq_entries = entries * 4;
+
+  int fd = io_uring_setup(entries, &p);
+  if (fd == -1) {
+    return -errno;
+  }
+  ring->fd = fd;
+
+  if (! (p.features & IORING_FEAT_SINGLE_MMAP) || ! (p.features & IORING_FEAT_EXT_ARG)) {
+    uring_destroy(ring);
+    return -EOPNOTSUPP;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->ring_ptr == MAP_FAILED) {
+    int err = -errno;
+    ring->ring_ptr = NULL;
+    uring_destroy(ring);
+    return err;
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    int err = -errno;
+    ring->sqes = NULL;
+    uring_destroy(ring);
+    return err;
+  }
+
+  char* ptr = ring->ring_ptr;
+  ring->sq_head = (unsigned int*) (ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned int*) (ptr + p.sq_off.tail);
+  ring->sq_mask = *(unsigned int*) (ptr + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->cq_head = (unsigned int*) (ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned int*) (ptr + p.cq_off.tail);
+  ring->cq_mask = *(unsigned int*) (ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (ptr + p.cq_off.cqes);
+
+  // sqe i always goes in slot i of the indirection array
+  unsigned int* array = (unsigned int*) (ptr + p.sq_off.array);
+  for (unsigned int i = 0; i < p.sq_entries; i++) {
+    array[i] = i;
+  }
+  ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+
+  return 0;
+}
+
+void uring_destroy(struct uring* ring) {
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->ring_ptr != NULL) {
+    munmap(ring->ring_ptr, ring->ring_size);
+  }
+  if (ring->fd != -1) {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+static int uring_submit(struct uring* ring, unsigned int min_complete, unsigned int flags, void* arg, size_t argsz) {
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  unsigned int to_submit = ring->sqe_tail - ring->sqe_submitted;
+
+  int ret = io_uring_enter(ring->fd, to_submit, min_complete, flags, arg, argsz);
+  if (ret == -1) {
+    return -errno;
+  }
+  ring->sqe_submitted += ret;
+  return ret;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+  unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    uring_submit(ring, 0, 0, NULL, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_submit_and_wait(struct uring* ring, int timeout_ms) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg = {0};
+
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    arg.ts = (unsigned long long) (uintptr_t) &ts;
+  }
+
+  while (1) {
+    int ret = uring_submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret != -EINTR) {
+      return ret;
+    }
+  }
+}
+
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring) {
+  unsigned int head = *ring->cq_head;
+  unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring* ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,45 @@
+#ifndef URING_HEADER
+#define URING_HEADER
+
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+// Just enough of io_uring for the event loop, on top of the raw syscalls:
+// a submission and a completion ring.
+struct uring {
+  int fd;
+
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int sqe_tail;      // sqes handed out, published on submit
+  unsigned int sqe_submitted; // sqes already given to the kernel
+  struct io_uring_sqe* sqes;
+
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void* ring_ptr;
+  size_t ring_size;
+  size_t sqes_size;
+};
+
+// Returns -errno when io_uring, or one of the features used here
+// (single mmap, extended enter arguments), is not available.
+int uring_init(struct uring*, unsigned int entries);
+void uring_destroy(struct uring*);
+
+// Returns a zeroed sqe, submitting the already prepared ones first if the
+// submission ring is full. NULL if that did not free any entry.
+struct io_uring_sqe* uring_get_sqe(struct uring*);
+// Submits the prepared sqes and waits for at least one completion, or
+// timeout_ms (-1 to wait forever). Returns -errno, -ETIME on timeout.
+int uring_submit_and_wait(struct uring*, int timeout_ms);
+
+struct io_uring_cqe* uring_peek_cqe(struct uring*);
+void uring_cqe_seen(struct uring*);
+
+#endif